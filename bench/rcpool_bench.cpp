@@ -0,0 +1,218 @@
+// Google Benchmark suite for the acquire/release paths, each case swept
+// over 1-64 threads. Besides throughput every case reports the p50,
+// p99 and p999 latency of the acquire alone, merged over all threads.
+//
+//   cmake -S . -B build -DRCPOOL_BENCHMARKS=ON && cmake --build build
+//   build/rcpool_bench --benchmark_filter=Saturated
+
+#include "rcpool.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+struct Res {
+    int payload = 0;
+};
+
+// builds in about 50us, a connect or handshake in miniature
+struct SlowRes {
+    SlowRes() {
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+        while (std::chrono::steady_clock::now() < until) {}
+    }
+
+    int payload = 0;
+};
+
+struct Cached : RCPoolPolicy {
+    static constexpr size_t thread_cache = 16;
+};
+
+struct Bitmap : LockFreeRCPoolPolicy {
+    using storage = BitmapStorage;
+};
+
+// the flavours under test, each building its pool the same way
+template <class INST_T, class POLICY>
+struct Single {
+    using Pool = RCPool<INST_T, POLICY>;
+
+    static std::unique_ptr<Pool> make(size_t idle_limit, size_t max_limit) {
+        return std::unique_ptr<Pool>(new Pool(idle_limit, max_limit));
+    }
+};
+
+template <class INST_T, class POLICY>
+struct Sharded {
+    using Pool = ShardedRCPool<INST_T, POLICY>;
+
+    static std::unique_ptr<Pool> make(size_t idle_limit, size_t max_limit) {
+        return std::unique_ptr<Pool>(new Pool(0, idle_limit, max_limit));
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Acquire latencies of every thread of one run, merged by the last
+// thread to finish, which alone reports the percentiles.
+class Latencies {
+public:
+    void add(benchmark::State & state, std::vector<int64_t> & mine) {
+        std::lock_guard<std::mutex> lk(lock);
+        all.insert(all.end(), mine.begin(), mine.end());
+        if (++done < static_cast<size_t>(state.threads())) return;
+        if (!all.empty()) {
+            std::sort(all.begin(), all.end());
+            auto at = [&](double q) -> double {
+                return static_cast<double>(all[std::min(all.size() - 1, static_cast<size_t>(q * all.size()))]);
+            };
+            state.counters["p50_ns"] = at(0.50);
+            state.counters["p99_ns"] = at(0.99);
+            state.counters["p999_ns"] = at(0.999);
+        }
+        all.clear();
+        done = 0;
+    }
+
+private:
+    std::mutex lock;
+    std::vector<int64_t> all;
+    size_t done = 0;
+};
+
+// per case, shared by the threads of a run; thread 0 builds it before
+// the timed loop and drops it after, both fenced by the loop's barriers
+template <class Flavor>
+struct Shared {
+    static std::unique_ptr<typename Flavor::Pool> pool;
+    static Latencies latencies;
+};
+
+template <class Flavor>
+std::unique_ptr<typename Flavor::Pool> Shared<Flavor>::pool;
+
+template <class Flavor>
+Latencies Shared<Flavor>::latencies;
+
+template <class Flavor>
+void get_put(benchmark::State & state, size_t idle_limit, size_t max_limit) {
+    using S = Shared<Flavor>;
+    if (state.thread_index() == 0) {
+        S::pool = Flavor::make(idle_limit, max_limit);
+    }
+    std::vector<int64_t> lat;
+    lat.reserve(1 << 16);
+    for (auto _ : state) {
+        auto t0 = Clock::now();
+        auto g = S::pool->get();
+        auto t1 = Clock::now();
+        if (!g) {
+            state.SkipWithError("get failed");
+            break;
+        }
+        benchmark::DoNotOptimize(g->payload++);
+        if (lat.size() < lat.capacity()) {
+            lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    S::latencies.add(state, lat);
+    if (state.thread_index() == 0) {
+        S::pool.reset();
+    }
+}
+
+// room for every thread, so gets find one idle or build it
+template <class Flavor>
+void BM_Uncontended(benchmark::State & state) {
+    get_put<Flavor>(state, 64, 128);
+}
+
+// four resources for up to 64 threads, gets queue at max_limit
+template <class Flavor>
+void BM_Saturated(benchmark::State & state) {
+    get_put<Flavor>(state, 4, 4);
+}
+
+// nothing stays idle, so every get builds a 50us resource
+template <class Flavor>
+void BM_SlowFactory(benchmark::State & state) {
+    get_put<Flavor>(state, 0, 64);
+}
+
+// get_n() of 8 at a time, RCPool only
+template <class Flavor>
+void BM_Batch(benchmark::State & state) {
+    using S = Shared<Flavor>;
+    const size_t batch = 8;
+    if (state.thread_index() == 0) {
+        S::pool = Flavor::make(64, 128);
+    }
+    std::vector<int64_t> lat;
+    lat.reserve(1 << 16);
+    for (auto _ : state) {
+        auto t0 = Clock::now();
+        auto b = S::pool->get_n(batch);
+        auto t1 = Clock::now();
+        if (b.size() != batch) {
+            state.SkipWithError("get_n failed");
+            break;
+        }
+        benchmark::DoNotOptimize(b[0]->payload++);
+        if (lat.size() < lat.capacity()) {
+            lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+    S::latencies.add(state, lat);
+    if (state.thread_index() == 0) {
+        S::pool.reset();
+    }
+}
+
+using Locked = Single<Res, RCPoolPolicy>;
+using LockFree = Single<Res, LockFreeRCPoolPolicy>;
+using Magazines = Single<Res, Cached>;
+using Bitmapped = Single<Res, Bitmap>;
+using ShardedLocked = Sharded<Res, RCPoolPolicy>;
+using ShardedLockFree = Sharded<Res, LockFreeRCPoolPolicy>;
+using SlowLocked = Single<SlowRes, RCPoolPolicy>;
+using SlowLockFree = Single<SlowRes, LockFreeRCPoolPolicy>;
+using SlowSharded = Sharded<SlowRes, RCPoolPolicy>;
+
+} // namespace
+
+#define RCPOOL_BENCH(fn, flavor) \
+    BENCHMARK_TEMPLATE(fn, flavor)->ThreadRange(1, 64)->UseRealTime()
+
+RCPOOL_BENCH(BM_Uncontended, Locked);
+RCPOOL_BENCH(BM_Uncontended, LockFree);
+RCPOOL_BENCH(BM_Uncontended, Magazines);
+RCPOOL_BENCH(BM_Uncontended, Bitmapped);
+RCPOOL_BENCH(BM_Uncontended, ShardedLocked);
+RCPOOL_BENCH(BM_Uncontended, ShardedLockFree);
+
+RCPOOL_BENCH(BM_Saturated, Locked);
+RCPOOL_BENCH(BM_Saturated, LockFree);
+RCPOOL_BENCH(BM_Saturated, Magazines);
+RCPOOL_BENCH(BM_Saturated, Bitmapped);
+RCPOOL_BENCH(BM_Saturated, ShardedLocked);
+
+RCPOOL_BENCH(BM_SlowFactory, SlowLocked);
+RCPOOL_BENCH(BM_SlowFactory, SlowLockFree);
+RCPOOL_BENCH(BM_SlowFactory, SlowSharded);
+
+RCPOOL_BENCH(BM_Batch, Locked);
+RCPOOL_BENCH(BM_Batch, LockFree);
+RCPOOL_BENCH(BM_Batch, Bitmapped);
+
+BENCHMARK_MAIN();
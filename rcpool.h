@@ -1,53 +1,4985 @@
 #ifndef _MK_RCPOOL_
-#define _MK_RPPOOL_
+#define _MK_RCPOOL_
 
+#include <unordered_set>
 #include <unordered_map>
+#include <vector>
+#include <array>
 #include <mutex>
 #include <memory>
 #include <condition_variable>
 #include <functional>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
 #include <exception>
 #include <string>
 #include <chrono>
+#include <new>
+#include <type_traits>
+#include <thread>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <cmath>
+#include <random>
+#if defined(__linux__)
+#include <sched.h>
+#include <fstream>
+#endif
+#if defined(__linux__) && __has_include(<execinfo.h>)
+#include <execinfo.h>
+#include <cstdlib>
+#define MK_RCPOOL_BACKTRACE 1
+#endif
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define MK_RCPOOL_COROUTINES 1
+#endif
+
+
+namespace mklib {
+
+namespace detail {
+    class GenericResourceException : public std::exception {
+        public:
+            GenericResourceException(const std::string & m) : msg_(m) {}
+            const char * what() const noexcept {return msg_.c_str();}
+        private:
+            std::string msg_;
+    };
+
+    class ResourceTimedoutException : public std::exception {
+        public:
+            ResourceTimedoutException(const std::string & m) : msg_(m) {}
+            const char * what() const noexcept {return msg_.c_str();}
+        private:
+            std::string msg_;
+    };
+
+    class ResourceUnavailableException : public std::exception {
+        public:
+            ResourceUnavailableException(const std::string & m) : msg_(m) {}
+            const char * what() const noexcept {return msg_.c_str();}
+        private:
+            std::string msg_;
+    };
+
+    // Intrusive LIFO of NODEs linked through NODE::lf_next. On x86-64,
+    // whose user addresses fit in 48 bits with 4-level paging, and on
+    // 32-bit targets it is lock-free: the head word packs the top node
+    // address with a modification tag in the bits above it, so a stale
+    // pop fails its CAS instead of hitting ABA. Other 64-bit targets
+    // keep their own tags up there (aarch64 top-byte-ignore, MTE), so
+    // there, or with MK_RCPOOL_LOCKED_STACKS defined (5-level paging
+    // handing out higher addresses), a mutex guards a plain head
+    // instead. Nodes must stay allocated while a racing pop may still
+    // read them.
+#if !defined(MK_RCPOOL_LOCKED_STACKS) && (defined(__x86_64__) || defined(_M_X64) || UINTPTR_MAX == 0xffffffffu)
+    constexpr bool packed_stacks = true;
+#else
+    constexpr bool packed_stacks = false;
+#endif
+
+    template <class NODE, bool PACKED = packed_stacks>
+    class TaggedStack {
+        public:
+            TaggedStack() : head_(0) {}
+
+            // disallow copy
+            TaggedStack(const TaggedStack & rhs) = delete;
+            TaggedStack & operator=(const TaggedStack & rhs) = delete;
+
+            void push(NODE * n) {
+                if constexpr (sizeof(void *) == 8) {
+                    if (reinterpret_cast<uintptr_t>(n) & ~addr_mask) too_wide(n);
+                }
+                uint64_t old = head_.load();
+                do {
+                    n->lf_next.store(addr(old), std::memory_order_relaxed);
+                } while (!head_.compare_exchange_weak(old, pack(n, old)));
+            }
+
+            NODE * pop() {
+                uint64_t old = head_.load();
+                NODE * n;
+                do {
+                    n = addr(old);
+                    if (!n) return nullptr;
+                } while (!head_.compare_exchange_weak(old, pack(n->lf_next.load(std::memory_order_relaxed), old)));
+                return n;
+            }
+
+            bool empty() const {
+                return addr(head_.load()) == nullptr;
+            }
+
+        private:
+            static_assert(sizeof(void *) == 8 || sizeof(void *) == 4, "TaggedStack packs 32 or 64-bit pointers");
+
+            static constexpr unsigned addr_bits = sizeof(void *) == 8 ? 48 : 32;
+            static constexpr uint64_t addr_mask = (uint64_t(1) << addr_bits) - 1;
+
+            static NODE * addr(uint64_t v) {
+                return reinterpret_cast<NODE *>(static_cast<uintptr_t>(v & addr_mask));
+            }
+
+            // new head word for n, tag bumped from the previous head
+            static uint64_t pack(NODE * n, uint64_t prev) {
+                uint64_t tag = (prev >> addr_bits) + 1;
+                return (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(n)) & addr_mask) | (tag << addr_bits);
+            }
+
+            // packing would lose address bits, nothing sane to do but stop
+            [[noreturn]] static void too_wide(NODE * n) {
+                std::fprintf(stderr, "rcpool: %p doesn't fit in %u bits, build with MK_RCPOOL_LOCKED_STACKS\n",
+                    static_cast<void *>(n), addr_bits);
+                std::abort();
+            }
+
+            std::atomic<uint64_t> head_;
+    };
+
+    // the locked fallback, for any pointer
+    template <class NODE>
+    class TaggedStack<NODE, false> {
+        public:
+            TaggedStack() = default;
+
+            // disallow copy
+            TaggedStack(const TaggedStack & rhs) = delete;
+            TaggedStack & operator=(const TaggedStack & rhs) = delete;
+
+            void push(NODE * n) {
+                std::lock_guard<std::mutex> lk(lock_);
+                n->lf_next.store(head_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                head_.store(n, std::memory_order_relaxed);
+            }
+
+            NODE * pop() {
+                std::lock_guard<std::mutex> lk(lock_);
+                NODE * n = head_.load(std::memory_order_relaxed);
+                if (n) head_.store(n->lf_next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                return n;
+            }
+
+            bool empty() const {
+                return head_.load() == nullptr;
+            }
+
+        private:
+            std::mutex lock_;
+            std::atomic<NODE *> head_{nullptr};
+    };
+
+    // index of the lowest set bit of a nonzero word, one tzcnt/bsf where
+    // the compiler has the builtin
+    inline size_t lowest_bit(uint64_t w) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<size_t>(__builtin_ctzll(w));
+#else
+        size_t i = 0;
+        for (; !(w & 1); w >>= 1) i++;
+        return i;
+#endif
+    }
+
+    // CPU to NUMA node map, read once from sysfs; a single node where
+    // that isn't available
+    class NumaTopology {
+        public:
+            static const NumaTopology & get() {
+                static const NumaTopology t;
+                return t;
+            }
+
+            size_t nodes() const {
+                return nodes_;
+            }
+
+            size_t node_of(int cpu) const {
+                return cpu >= 0 && static_cast<size_t>(cpu) < cpu_node_.size() ? cpu_node_[cpu] : 0;
+            }
+
+        private:
+            NumaTopology() {
+#if defined(__linux__)
+                std::ifstream online("/sys/devices/system/node/online");
+                std::string nodes;
+                if (!std::getline(online, nodes)) return;
+                size_t last = 0;
+                for_each_in_list(nodes, [&](size_t node) {
+                    std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                    std::string cpus;
+                    if (!std::getline(f, cpus)) return;
+                    for_each_in_list(cpus, [&](size_t cpu) {
+                        if (cpu >= cpu_node_.size()) cpu_node_.resize(cpu + 1, 0);
+                        cpu_node_[cpu] = node;
+                    });
+                    last = std::max(last, node);
+                });
+                nodes_ = last + 1;
+#endif
+            }
+
+            // sysfs list format, "0-3,8,10-11"
+            template <class F>
+            static void for_each_in_list(const std::string & list, F f) {
+                size_t i = 0;
+                while (i < list.size()) {
+                    size_t end = std::min(list.find(',', i), list.size());
+                    std::string part = list.substr(i, end - i);
+                    size_t dash = part.find('-');
+                    try {
+                        size_t lo = std::stoul(part.substr(0, dash));
+                        size_t hi = dash == std::string::npos ? lo : std::stoul(part.substr(dash + 1));
+                        for (size_t v = lo; v <= hi && v < 65536; v++) f(v);
+                    }
+                    catch (...) {
+                        // skip a malformed entry
+                    }
+                    i = end + 1;
+                }
+            }
+
+            std::vector<size_t> cpu_node_;
+            size_t nodes_ = 1;
+    };
+}
+
+// Storage policies for RCPoolPolicy::storage.
+
+// Each resource gets its own heap slot, allocated when it is created.
+struct HeapStorage {};
+
+// All max_limit slots live in one cache-line aligned array allocated
+// with the pool. Resources are placement-constructed into free slots,
+// and a returned slot is validated with a range check.
+struct ArenaStorage {
+    static constexpr size_t cache_line = 64;
+};
+
+// ArenaStorage for large pools of small objects: which slots are free
+// and which are checked out lives in two cache-line aligned bitmaps
+// rather than a free list and a flag per slot. A build claims the
+// lowest free bit of the first nonzero word found from a rotating hint,
+// and a return clears its checked-out bit atomically after a range
+// check, so a double put is caught by one bit test in lock-free mode too.
+struct BitmapStorage : ArenaStorage {};
+
+// Factory policies for RCPoolPolicy::factory.
+
+// Constructs INST_T in place from the arguments given to RCPool's
+// constructor. With none it is a plain INST_T() the compiler can inline;
+// otherwise a copy of them is kept with a function pointer that knows
+// their types, never a std::function.
+struct ArgsFactory {};
+
+// What the pool knows about a resource it asks a factory to build.
+struct RCPoolSlotInfo {
+    static constexpr size_t npos = ~size_t(0);
+
+    // ShardedRCPool shard index, 0 for a plain RCPool
+    size_t shard;
+    // arena slot index with ArenaStorage, else npos
+    size_t slot;
+    // resources the pool built before this one
+    uint64_t serial;
+};
+
+// Calls the std::function<INST_T *(void * where)> given as RCPool's
+// constructor argument, for a creator only known at run time. Opt in
+// with: using factory = FunctionFactory<INST_T>;
+template <class INST_T>
+struct FunctionFactory {
+    explicit FunctionFactory(std::function<INST_T *(void *)> fn_) : fn(std::move(fn_)) {}
+
+    INST_T * create(void * where, const RCPoolSlotInfo &) {
+        return fn(where);
+    }
+
+    std::function<INST_T *(void *)> fn;
+};
+
+namespace detail {
+    // optional RCPoolPolicy::factory members
+    template <class F, class T, class = void>
+    struct has_factory_destroy : std::false_type {};
+
+    template <class F, class T>
+    struct has_factory_destroy<F, T, std::void_t<decltype(std::declval<F &>().destroy(std::declval<T *>()))>> :
+        std::true_type {};
+
+    template <class F, class T, class = void>
+    struct has_factory_create_n : std::false_type {};
+
+    template <class F, class T>
+    struct has_factory_create_n<F, T, std::void_t<decltype(std::declval<size_t &>() = std::declval<F &>().create_n(
+        std::declval<void * const *>(), std::declval<const RCPoolSlotInfo *>(), size_t(), std::declval<T **>()))>> :
+        std::true_type {};
+
+    // ArgsFactory's creator: INST_T(lead..., args...) placed at where,
+    // lead being what the pool passes per resource (KeyedRCPool's key)
+    // and args a copy of the constructor arguments, if any.
+    template <class INST_T, class... Lead>
+    class ArgsCreator {
+        public:
+            template <class... Args>
+            explicit ArgsCreator(Args&&... _args) {
+                if constexpr (sizeof...(Args) > 0) {
+                    using Tuple = std::tuple<std::decay_t<Args>...>;
+                    args_ = new Tuple(std::forward<Args>(_args)...);
+                    make_ = [](const void * a, void * where, const Lead &... lead) -> INST_T * {
+                        return std::apply([&](const auto &... v) { return new (where) INST_T(lead..., v...); },
+                            *static_cast<const Tuple *>(a));
+                    };
+                    drop_ = [](void * a) { delete static_cast<Tuple *>(a); };
+                }
+                else {
+                    static_assert(std::is_constructible<INST_T, const Lead &...>::value,
+                        "INST_T can't be built without constructor arguments");
+                }
+            }
+
+            ~ArgsCreator() {
+                if (drop_) drop_(args_);
+            }
+
+            // disallow copy
+            ArgsCreator(const ArgsCreator & rhs) = delete;
+            ArgsCreator & operator=(const ArgsCreator & rhs) = delete;
+
+            INST_T * operator()(void * where, const Lead &... lead) const {
+                if constexpr (std::is_constructible<INST_T, const Lead &...>::value) {
+                    if (!make_) return new (where) INST_T(lead...);
+                }
+                return make_(args_, where, lead...);
+            }
+
+        private:
+            void * args_ = nullptr;
+            INST_T * (*make_)(const void *, void *, const Lead &...) = nullptr;
+            void (*drop_)(void *) = nullptr;
+    };
+
+    // Atomic bitmap over a fixed number of slots, in whole cache lines.
+    class SlotBitmap {
+        public:
+            static constexpr size_t npos = ~size_t(0);
+
+            SlotBitmap() = default;
+
+            // disallow copy
+            SlotBitmap(const SlotBitmap & rhs) = delete;
+            SlotBitmap & operator=(const SlotBitmap & rhs) = delete;
+
+            // n bits, all of them set or all clear
+            void reset(size_t n, bool set) {
+                words_ = (n + word_bits - 1) / word_bits;
+                lines_.reset(new Line[(words_ + Line::words - 1) / Line::words]);
+                for (size_t w = 0; set && w < words_; w++) {
+                    size_t bits = std::min(n - w * word_bits, word_bits);
+                    word(w).store(bits == word_bits ? ~uint64_t(0) : (uint64_t(1) << bits) - 1);
+                }
+            }
+
+            // false if it was already set
+            bool set(size_t i) {
+                return !(word(i / word_bits).fetch_or(bit(i)) & bit(i));
+            }
+
+            // false if it was already clear
+            bool clear(size_t i) {
+                return word(i / word_bits).fetch_and(~bit(i)) & bit(i);
+            }
+
+            // clear and return some set bit, npos if none is; the scan
+            // starts at the word the last take() found one in
+            size_t take() {
+                size_t start = hint_.load(std::memory_order_relaxed);
+                for (size_t k = 0; k < words_; k++) {
+                    size_t w = start + k < words_ ? start + k : start + k - words_;
+                    std::atomic<uint64_t> & a = word(w);
+                    uint64_t v = a.load(std::memory_order_relaxed);
+                    while (v) {
+                        uint64_t b = v & (~v + 1);
+                        if (a.compare_exchange_weak(v, v & ~b)) {
+                            hint_.store(w, std::memory_order_relaxed);
+                            return w * word_bits + lowest_bit(b);
+                        }
+                    }
+                }
+                return npos;
+            }
+
+        private:
+            static constexpr size_t word_bits = 64;
+
+            struct alignas(64) Line {
+                static constexpr size_t words = 8;
+                std::atomic<uint64_t> w[words]{};
+            };
+
+            static uint64_t bit(size_t i) {
+                return uint64_t(1) << (i % word_bits);
+            }
+
+            std::atomic<uint64_t> & word(size_t w) {
+                return lines_[w / Line::words].w[w % Line::words];
+            }
+
+            std::unique_ptr<Line[]> lines_;
+            size_t words_ = 0;
+            std::atomic<size_t> hint_{0};
+    };
+}
+
+// Compile-time pool behaviour. Derive from RCPoolPolicy and override the
+// members you want to change, then pass it as RCPool's second argument.
+struct RCPoolPolicy {
+    // Keep idle resources in a lock-free stack and track checked-out ones
+    // with a counter only, so get()/put() skip cvlock whenever an idle
+    // resource exists. The pool mutex is only taken to create, destroy or
+    // wait for a resource.
+    static constexpr bool lock_free = false;
+
+    // Per-thread magazine capacity, 0 disables. Each thread keeps up to
+    // this many idle resources per pool that its get()/put() use before
+    // touching the shared pool, exchanging half a magazine at a time with
+    // it and draining on thread exit. Cached resources count as in use
+    // for idle_limit, and a get() about to wait steals from them.
+    static constexpr size_t thread_cache = 0;
+
+    // Leases given up with GetWrapper::release_later() wait in a per-thread
+    // buffer until this many pile up, then go back together with one
+    // critical section per pool. A get() about to wait or fail takes back
+    // what other threads hold buffered for its pool. 0 releases them
+    // right away, as does a thread cache, which already keeps releases
+    // off the shared pool.
+    static constexpr size_t release_batch = 32;
+
+    // Where resources live, HeapStorage, ArenaStorage or BitmapStorage.
+    using storage = HeapStorage;
+
+    // How resources are built. ArgsFactory constructs INST_T from RCPool's
+    // constructor arguments, FunctionFactory<INST_T> calls a std::function
+    // given as the one argument. Any other type is constructed from those
+    // arguments instead, held by value in the pool and called directly,
+    // unlocked and possibly from several threads at once:
+    //   INST_T * create(void * where, const RCPoolSlotInfo & info);
+    // placement-constructs a resource at where, throwing on failure.
+    // Optional members:
+    //   void destroy(INST_T * p) noexcept;
+    // ends p's lifetime instead of ~INST_T, and
+    //   size_t create_n(void * const * where, const RCPoolSlotInfo * info,
+    //                   size_t n, INST_T ** out);
+    // builds up to n resources at once for get_n() and returns how many
+    // it made; a shortfall or a throw leaves the rest to create().
+    using factory = ArgsFactory;
+
+    // Resources the keeper builds at once when min_idle, or a warm()
+    // given no executor, leaves the pool short, at most the shortfall:
+    // it builds one itself and each of the others on a thread started
+    // for the round, so a deep refill takes about one construction. 1
+    // builds them one after another on the keeper.
+    static constexpr size_t refill_threads = 4;
+
+    // Serve blocked get() callers first come, first served. Each waiter
+    // parks on its own node in a FIFO and a release hands the resource
+    // (or the capacity to build one) straight to the head, waking only
+    // that thread. New callers queue behind existing waiters instead of
+    // barging; get_n() batches still wait on the shared wakeup. Needs
+    // the locked idle list: the lock_free and thread_cache fast paths
+    // hand out idle resources without looking at the queue, so neither
+    // combines with it.
+    static constexpr bool fair = false;
+
+    // ShardedRCPool picks a thread's home shard by the CPU it is running
+    // on where that is cheap to ask (Linux), else by its thread id.
+    static constexpr bool shard_by_cpu = true;
+
+    // ShardedRCPool instead keeps one shard per NUMA node (shards of 0)
+    // and homes a thread on its node's shard. Resources are built by the
+    // borrowing thread, so first-touch places the memory they allocate
+    // on its node. A get only borrows another node's idle resources once
+    // its own shard is exhausted, and builds into another node's shard
+    // only after waiting on its own. ArenaStorage slots are allocated up
+    // front by the constructing thread, HeapStorage ones by the builder.
+    static constexpr bool shard_by_node = false;
+
+    // Record get()/put() latencies and failure counts for stats(), in
+    // per-thread stripes of relaxed counters. Off compiles it all out.
+    static constexpr bool stats = false;
+
+    // Per-resource bookkeeping for the runtime hooks: build and idle
+    // times for set_max_lifetime(), set_idle_ttl() and set_validate()'s
+    // idle_over, a borrow count for its every_n, and a footprint reading
+    // for set_footprint(). Off drops it from every slot, worth it for
+    // many small resources, and those setters no longer compile.
+    static constexpr bool slot_hooks = true;
+
+    // Stamp every lease for set_hold_watch() and held_leases(): a
+    // handout time and trace flags in every slot, and in lock-free heap
+    // mode a locked list of every node allocated. Off compiles it all
+    // out.
+    static constexpr bool hold_watch = false;
+};
+
+// Log2 latency histogram, buckets[i] counts samples in [2^i, 2^(i+1)) ns.
+struct RCPoolHistogram {
+    std::array<uint64_t, 64> buckets{};
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+
+    void merge(const RCPoolHistogram & o) {
+        for (size_t i = 0; i < buckets.size(); i++) {
+            buckets[i] += o.buckets[i];
+        }
+        count += o.count;
+        sum_ns += o.sum_ns;
+    }
+
+    uint64_t mean_ns() const {
+        return count ? sum_ns / count : 0;
+    }
+
+    // upper bound of the bucket holding quantile q, e.g. 0.99
+    uint64_t percentile_ns(double q) const {
+        uint64_t rank = static_cast<uint64_t>(q * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen > rank) return i < 63 ? (uint64_t(2) << i) - 1 : ~uint64_t(0);
+        }
+        return 0;
+    }
+};
+
+struct RCPoolStats {
+    // get() entry to lease or failure, async gets from request to delivery
+    RCPoolHistogram acquire_wait;
+    // factory calls
+    RCPoolHistogram construct;
+    // lease handout to release
+    RCPoolHistogram hold;
+    uint64_t gets = 0;
+    uint64_t timeouts = 0;
+    uint64_t ctor_failures = 0;
+    // cvlock found taken on the get/put paths
+    uint64_t contended = 0;
+
+    void merge(const RCPoolStats & o) {
+        acquire_wait.merge(o.acquire_wait);
+        construct.merge(o.construct);
+        hold.merge(o.hold);
+        gets += o.gets;
+        timeouts += o.timeouts;
+        ctor_failures += o.ctor_failures;
+        contended += o.contended;
+    }
+};
+
+// Pool counts at one instant, see RCPool::snapshot().
+struct RCPoolSnapshot {
+    // every resource the pool accounts for, and those of them idle
+    size_t total = 0;
+    size_t idle = 0;
+    // total minus idle: checked out, thread-cached, or being built or
+    // destroyed
+    size_t in_use = 0;
+    // blocked and queued gets
+    size_t waiters = 0;
+    size_t max_limit = 0;
+    // highest total and in_use since the pool was built or reset_peaks()
+    size_t peak_total = 0;
+    size_t peak_in_use = 0;
+
+    // sums, so merged peaks are an upper bound
+    void merge(const RCPoolSnapshot & o) {
+        total += o.total;
+        idle += o.idle;
+        in_use += o.in_use;
+        waiters += o.waiters;
+        max_limit += o.max_limit;
+        peak_total += o.peak_total;
+        peak_in_use += o.peak_in_use;
+    }
+};
+
+// Prometheus / OpenMetrics text for named pools' snapshots: one gauge
+// family per field, a sample per pool labelled pool="<name>". End the
+// scrape with "# EOF\n" for OpenMetrics.
+inline std::string to_openmetrics(const std::vector<std::pair<std::string, RCPoolSnapshot>> & pools,
+    const std::string & prefix = "rcpool")
+{
+    std::vector<std::string> labels;
+    for (auto & p : pools) {
+        std::string label = "{pool=\"";
+        for (char c : p.first) {
+            if (c == '\\' || c == '"') label += '\\';
+            if (c == '\n') {
+                label += "\\n";
+                continue;
+            }
+            label += c;
+        }
+        labels.push_back(label + "\"} ");
+    }
+
+    std::string out;
+    auto gauge = [&](const char * name, const char * help, size_t RCPoolSnapshot::*field) {
+        std::string metric = prefix + "_" + name;
+        out += "# TYPE " + metric + " gauge\n";
+        out += "# HELP " + metric + " " + help + "\n";
+        for (size_t i = 0; i < pools.size(); i++) {
+            out += metric + labels[i] + std::to_string(pools[i].second.*field) + "\n";
+        }
+    };
+    gauge("resources", "Resources the pool accounts for.", &RCPoolSnapshot::total);
+    gauge("idle", "Idle resources.", &RCPoolSnapshot::idle);
+    gauge("in_use", "Resources checked out or in transit.", &RCPoolSnapshot::in_use);
+    gauge("waiters", "Blocked or queued gets.", &RCPoolSnapshot::waiters);
+    gauge("max_limit", "Current max_limit.", &RCPoolSnapshot::max_limit);
+    gauge("resources_peak", "Highest resource count since the last peak reset.", &RCPoolSnapshot::peak_total);
+    gauge("in_use_peak", "Highest in-use count since the last peak reset.", &RCPoolSnapshot::peak_in_use);
+    return out;
+}
+
+inline std::string to_openmetrics(const RCPoolSnapshot & s, const std::string & pool,
+    const std::string & prefix = "rcpool")
+{
+    return to_openmetrics({ { pool, s } }, prefix);
+}
+
+// Bounds and pace for RCPool::set_autosize().
+struct RCPoolAutoSize {
+    // max_limit stays within [min_limit, max_limit], a max_limit of 0
+    // means the one the pool was built with
+    size_t min_limit = 1;
+    size_t max_limit = 0;
+    // how often the keeper looks, zero() disables
+    std::chrono::milliseconds interval{250};
+    // a blocking get waiting longer than this counts as queueing
+    std::chrono::microseconds wait_target{1000};
+};
+
+// Long-hold detection for RCPool::set_hold_watch().
+struct RCPoolHoldWatch {
+    // leases held longer than this are reported, zero() disables
+    std::chrono::milliseconds threshold{0};
+    // keep the acquiring stack of one lease in every sample_every (where
+    // backtrace() exists), 0 never
+    size_t sample_every = 1024;
+};
+
+// Circuit breaker for RCPool::set_breaker().
+struct RCPoolBreaker {
+    // consecutive construction failures that open it, 0 disables
+    size_t failures = 5;
+    // how long it stays open, doubling each time a probe fails, up to
+    // max_backoff
+    std::chrono::milliseconds backoff{100};
+    std::chrono::milliseconds max_backoff{30000};
+    // each backoff is cut by a random fraction of itself up to this, so
+    // pools that tripped together don't probe together
+    double jitter = 0.5;
+};
+
+// What acquire_all() sleeps on while it waits for several pools: each
+// of them bumps it when a release or a limit change may let a get
+// through, so it looks again without holding anything in between.
+class RCPoolWatch {
+public:
+    using Deadline = std::chrono::steady_clock::time_point;
+
+    RCPoolWatch() = default;
+
+    // disallow copy
+    RCPoolWatch(const RCPoolWatch & rhs) = delete;
+    RCPoolWatch & operator=(const RCPoolWatch & rhs) = delete;
+
+    uint64_t generation() {
+        std::lock_guard<std::mutex> lk(lock);
+        return gen;
+    }
+
+    // false once deadline passes with no bump since seen
+    bool wait(uint64_t seen, Deadline deadline) {
+        std::unique_lock<std::mutex> lk(lock);
+        if (gen != seen) return std::chrono::steady_clock::now() < deadline;
+        if (deadline == Deadline::max()) {
+            cv.wait(lk, [&]{ return gen != seen; });
+            return true;
+        }
+        return cv.wait_until(lk, deadline, [&]{ return gen != seen; });
+    }
+
+    // called by the pools under their own lock
+    void poke() {
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            gen++;
+        }
+        cv.notify_one();
+    }
+
+    template <class P>
+    void attach(P & pool) {
+        pool.watch(this);
+    }
+
+    // harmless for a pool attach() never reached
+    template <class P>
+    void detach(P & pool) {
+        pool.unwatch(this);
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    uint64_t gen = 0;
+};
+
+template <class INST_T, class POLICY>
+class ShardedRCPool;
+
+template <class KEY, class INST_T, class HASH = std::hash<KEY>>
+class KeyedRCPool;
+
+struct LockFreeRCPoolPolicy : RCPoolPolicy {
+    static constexpr bool lock_free = true;
+};
+
+// Policies for a pool used from one thread only, e.g. an event loop:
+// RCPool<T, SingleThreaded> or RCPool<T, Fixed<64>>. They replace the
+// whole pool rather than tune it, see SingleThreadedRCPool; the other
+// RCPoolPolicy members don't apply.
+
+// slots for max_limit resources, allocated once by the constructor
+struct SingleThreaded {};
+
+// slots for N resources inline in the pool object, never allocated
+template <size_t N>
+struct Fixed {
+    static_assert(N > 0, "Fixed<N> needs room for a resource");
+};
+
+template <class INST_T, class POLICY = RCPoolPolicy>
+class RCPool
+{
+    static_assert(!(POLICY::fair && (POLICY::lock_free || POLICY::thread_cache > 0)),
+        "fair = true needs lock_free = false and thread_cache = 0");
+
+    class InnerRCPool;
+    struct Slot;
+    struct AsyncOp;
+
+public:
+    class GetBatch;
+
+public:
+    enum class GetStatus {
+        SUCCESS,
+        CTORF,
+        TIMEOUT,
+        UNKNOWN,
+        CANCELED,
+        CIRCUIT_OPEN
+    };
+
+    // HIGH gets may use the capacity set_reserved() holds back, and are
+    // served before NORMAL waiters
+    enum class GetPriority {
+        NORMAL,
+        HIGH
+    };
+
+    // Move-only handle to a checked-out resource. It is two raw pointers
+    // and a status; the pool it came from stays alive until every
+    // outstanding handle is released, even past ~RCPool.
+    class GetWrapper {
+        public:
+            GetWrapper(
+                InnerRCPool * pool, Slot * slot, GetStatus err) :
+                rcpool_(pool), slot_(slot), err_(err)
+            {}
+
+            // disallow copy
+            GetWrapper(const GetWrapper & rhs) = delete;
+            GetWrapper & operator=(const GetWrapper & rhs) = delete;
+
+            // allow move
+            GetWrapper(GetWrapper && rhs)
+                : rcpool_(rhs.rcpool_), slot_(rhs.slot_), err_(rhs.err_)
+            {
+                // this obj is responsible for release.
+                rhs.slot_ = nullptr;
+            }
+
+            GetWrapper & operator=(GetWrapper && rhs) {
+                // release mine
+                if (slot_) {
+                    rcpool_->inner_put(slot_);
+                    slot_ = nullptr;
+                }
+
+                // inherit other
+                rcpool_ = rhs.rcpool_;
+                slot_ = rhs.slot_;
+                err_ = rhs.err_;
+
+                // rhs doesn't need release
+                rhs.slot_ = nullptr;
+
+                return *this;
+            }
+
+            ~GetWrapper() {
+                // need release to pool
+                if (slot_) {
+                    rcpool_->inner_put(slot_);
+                }
+            }
+
+            INST_T * operator->() {
+                return get();
+            }
+
+            INST_T * get() {
+                return slot_ ? slot_->inst : nullptr;
+            }
+
+            operator bool() {
+                return slot_ != nullptr;
+            }
+
+            GetStatus err() {
+                return err_;
+            }
+
+            const char* explain_error() {
+                return explain(err_);
+            }
+
+            // Give the lease up without returning it yet: it joins this
+            // thread's release buffer, see RCPoolPolicy::release_batch and
+            // flush_released(). The buffer is flushed early when the pool
+            // has waiters and before this thread blocks on a pool of the
+            // same type, and a get() on another thread that would wait
+            // takes the pool's leases back from it, running the reset
+            // hook there. Moving the wrapper to another thread first
+            // hands that thread the release.
+            void release_later() {
+                if (slot_) {
+                    rcpool_->put_later(slot_);
+                    slot_ = nullptr;
+                }
+            }
+
+        private:
+            friend class RCPool;
+
+            InnerRCPool * rcpool_;
+            Slot * slot_;
+            GetStatus err_;
+    };
+
+    using Lease = GetWrapper;
+
+    // Move-only set of leases taken together by get_n(). Releasing it,
+    // by put_n() or on destruction, returns everything still held in one
+    // critical section per pool with a single wakeup.
+    class GetBatch {
+        public:
+            GetBatch(std::vector<GetWrapper> && leases, GetStatus err) :
+                leases_(std::move(leases)), err_(err)
+            {}
+
+            // disallow copy
+            GetBatch(const GetBatch & rhs) = delete;
+            GetBatch & operator=(const GetBatch & rhs) = delete;
+
+            // allow move
+            GetBatch(GetBatch && rhs) = default;
+
+            GetBatch & operator=(GetBatch && rhs) {
+                release();
+                leases_ = std::move(rhs.leases_);
+                err_ = rhs.err_;
+                return *this;
+            }
+
+            ~GetBatch() {
+                release();
+            }
+
+            GetWrapper & operator[](size_t i) {
+                return leases_[i];
+            }
+
+            typename std::vector<GetWrapper>::iterator begin() {
+                return leases_.begin();
+            }
+
+            typename std::vector<GetWrapper>::iterator end() {
+                return leases_.end();
+            }
+
+            size_t size() {
+                return leases_.size();
+            }
+
+            operator bool() {
+                return err_ == GetStatus::SUCCESS;
+            }
+
+            GetStatus err() {
+                return err_;
+            }
+
+            const char* explain_error() {
+                return explain(err_);
+            }
+
+            void release() {
+                std::vector<Slot *> slots;
+                slots.reserve(leases_.size());
+                size_t first = 0;
+                // one central_put per run of leases from the same pool
+                for (size_t i = 0; i <= leases_.size(); i++) {
+                    if (i == leases_.size() || (slots.size() > first && leases_[i].rcpool_ != leases_[i - 1].rcpool_)) {
+                        if (slots.size() > first) {
+                            leases_[i - 1].rcpool_->central_put(slots.data() + first, slots.size() - first);
+                        }
+                        first = slots.size();
+                    }
+                    if (i < leases_.size() && leases_[i].slot_) {
+                        leases_[i].rcpool_->record_hold(leases_[i].slot_);
+                        leases_[i].rcpool_->reset_on_return(leases_[i].slot_);
+                        slots.push_back(leases_[i].slot_);
+                        leases_[i].slot_ = nullptr;
+                    }
+                }
+                leases_.clear();
+            }
+
+        private:
+            std::vector<GetWrapper> leases_;
+            GetStatus err_;
+    };
+
+    // _args construct each INST_T, or the policy's factory once
+    template <class... Args>
+    RCPool(size_t idle_limit_, size_t max_limit_, Args&&... _args) {
+        inner_pool_ = new InnerRCPool(idle_limit_, max_limit_, std::forward<Args>(_args)...);
+    }
+
+    // disallow copy
+    RCPool(const RCPool & rhs) = delete;
+    RCPool & operator=(const RCPool & rhs) = delete;
+
+    // disallow copy
+    RCPool(RCPool && rhs) = delete;
+    RCPool & operator=(RCPool && rhs) = delete;
+
+    virtual ~RCPool() {
+        // deleted here or by the last outstanding GetWrapper
+        inner_pool_->retire();
+    }
+
+    // timeout_s of 0 waits forever
+    GetWrapper get(uint32_t timeout_s = 0, GetPriority prio = GetPriority::NORMAL) {
+        return get(deadline_after(timeout_s), prio);
+    }
+
+    // waits at most timeout, zero or less doesn't wait at all
+    template <class Rep, class Period>
+    GetWrapper get(std::chrono::duration<Rep, Period> timeout, GetPriority prio = GetPriority::NORMAL) {
+        return get(deadline_in(timeout), prio);
+    }
+
+    GetWrapper get(std::chrono::steady_clock::time_point deadline, GetPriority prio = GetPriority::NORMAL) {
+        Deadline t0 = inner_pool_->stat_clock();
+        GetStatus err;
+        try {
+            Slot * s;
+            do {
+                // a resource failing validation is discarded, try again
+                s = inner_pool_->inner_get(deadline, prio);
+            } while (!inner_pool_->borrow_ok(s));
+            inner_pool_->record_get(t0, &s, 1, GetStatus::SUCCESS);
+            return { inner_pool_, s, GetStatus::SUCCESS};
+        }
+        catch (const detail::ResourceTimedoutException &e) {
+            err = GetStatus::TIMEOUT;
+        }
+        catch (const detail::GenericResourceException &e) {
+            err = GetStatus::CTORF;
+        }
+        catch (const detail::ResourceUnavailableException &e) {
+            err = GetStatus::CIRCUIT_OPEN;
+        }
+        catch (...) {
+            err = GetStatus::UNKNOWN;
+        }
+        inner_pool_->record_get(t0, nullptr, 0, err);
+        return { nullptr, nullptr, err };
+    }
+
+    // Never waits on cvlock's condition: TIMEOUT right away when nothing
+    // is idle and max_limit is reached. It may still construct a resource.
+    GetWrapper try_get(GetPriority prio = GetPriority::NORMAL) {
+        return get(std::chrono::steady_clock::time_point::min(), prio);
+    }
+
+    // Take count resources at once, or none: reservation happens in one
+    // critical section and nothing is held while waiting, so callers
+    // asking for overlapping sets can't deadlock each other. A count
+    // above max_limit can never be met and fails as TIMEOUT right away.
+    GetBatch get_n(size_t count, uint32_t timeout_s = 0) {
+        return get_n(count, deadline_after(timeout_s));
+    }
+
+    template <class Rep, class Period>
+    GetBatch get_n(size_t count, std::chrono::duration<Rep, Period> timeout) {
+        return get_n(count, deadline_in(timeout));
+    }
+
+    GetBatch get_n(size_t count, std::chrono::steady_clock::time_point deadline) {
+        Deadline t0 = inner_pool_->stat_clock();
+        std::vector<GetWrapper> leases;
+        GetStatus err;
+        try {
+            leases.reserve(count);
+            std::vector<Slot *> slots(count);
+            inner_pool_->inner_get_n(slots.data(), count, deadline);
+            for (size_t good = inner_pool_->borrow_ok_n(slots.data(), count); good < count; ) {
+                // replace the ones that failed validation, all or nothing
+                try {
+                    inner_pool_->inner_get_n(slots.data() + good, count - good, deadline);
+                }
+                catch (...) {
+                    inner_pool_->central_put(slots.data(), good);
+                    throw;
+                }
+                good += inner_pool_->borrow_ok_n(slots.data() + good, count - good);
+            }
+            inner_pool_->record_get(t0, slots.data(), count, GetStatus::SUCCESS);
+            for (Slot * s : slots) {
+                leases.emplace_back(inner_pool_, s, GetStatus::SUCCESS);
+            }
+            return { std::move(leases), GetStatus::SUCCESS };
+        }
+        catch (const detail::ResourceTimedoutException &e) {
+            err = GetStatus::TIMEOUT;
+        }
+        catch (const detail::GenericResourceException &e) {
+            err = GetStatus::CTORF;
+        }
+        catch (const detail::ResourceUnavailableException &e) {
+            err = GetStatus::CIRCUIT_OPEN;
+        }
+        catch (...) {
+            err = GetStatus::UNKNOWN;
+        }
+        inner_pool_->record_get(t0, nullptr, 0, err);
+        return { std::move(leases), err };
+    }
+
+    void put_n(GetBatch & batch) {
+        batch.release();
+    }
+
+    // Runs a task on the caller's threads, e.g. by posting it to an event
+    // loop. It must not run the task inline. An empty Executor runs it
+    // where the request completes, inside async_get() or on the pool's
+    // keeper thread.
+    using Executor = std::function<void(std::function<void()>)>;
+    using GetCallback = std::function<void(GetWrapper)>;
+
+    // Handle to a pending async_get(). Dropping it leaves the request
+    // pending. Holding it keeps the pool's bookkeeping alive, not the
+    // RCPool itself.
+    class AsyncGet {
+        public:
+            AsyncGet() = default;
+
+            // complete the request with CANCELED, false if it was
+            // already served or failed
+            bool cancel() {
+                return op_ && op_->cancel();
+            }
+
+        private:
+            friend class RCPool;
+
+            explicit AsyncGet(std::shared_ptr<AsyncOp> op) : op_(std::move(op)) {}
+
+            std::shared_ptr<AsyncOp> op_;
+    };
+
+    // Non-blocking get(): queues the request and returns at once. cb gets
+    // the lease on ex once a resource is free, built if need be, or a
+    // failed lease with TIMEOUT, CTORF or CANCELED. Pending requests cost
+    // a queue node, not a thread, and are served in arrival order.
+    AsyncGet async_get(Executor ex, GetCallback cb,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        auto op = std::make_shared<AsyncOp>(inner_pool_, std::move(ex), std::move(cb), deadline);
+        inner_pool_->async_start(op);
+        return AsyncGet(std::move(op));
+    }
+
+    template <class Rep, class Period>
+    AsyncGet async_get(Executor ex, GetCallback cb, std::chrono::duration<Rep, Period> timeout) {
+        return async_get(std::move(ex), std::move(cb), deadline_in(timeout));
+    }
+
+#ifdef MK_RCPOOL_COROUTINES
+    // co_await pool.async_get(ex) suspends the coroutine until served and
+    // resumes it on ex with the lease, see the callback async_get().
+    class GetAwaiter {
+        public:
+            GetAwaiter(InnerRCPool * pool, Executor ex, std::chrono::steady_clock::time_point deadline) :
+                op_(std::make_shared<AsyncOp>(pool, std::move(ex), nullptr, deadline))
+            {}
+
+            // disallow copy
+            GetAwaiter(const GetAwaiter & rhs) = delete;
+            GetAwaiter & operator=(const GetAwaiter & rhs) = delete;
+
+            bool await_ready() {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> h) {
+                op_->cb = [this, h](GetWrapper g) {
+                    result_ = std::move(g);
+                    h.resume();
+                };
+                // we may be resumed and gone before async_start returns
+                std::shared_ptr<AsyncOp> op = op_;
+                op->pool->async_start(op);
+            }
+
+            GetWrapper await_resume() {
+                return std::move(result_);
+            }
+
+            // safe from any thread, see AsyncGet::cancel()
+            bool cancel() {
+                return op_->cancel();
+            }
+
+        private:
+            std::shared_ptr<AsyncOp> op_;
+            GetWrapper result_{nullptr, nullptr, GetStatus::UNKNOWN};
+    };
+
+    GetAwaiter async_get(Executor ex,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        return GetAwaiter(inner_pool_, std::move(ex), deadline);
+    }
+
+    template <class Rep, class Period>
+    GetAwaiter async_get(Executor ex, std::chrono::duration<Rep, Period> timeout) {
+        return async_get(std::move(ex), deadline_in(timeout));
+    }
+#endif
+
+    // Keep at least n resources idle (within max_limit), rebuilt on the
+    // keeper thread whenever gets drain the pool below that. 0 disables.
+    void set_min_idle(size_t n) {
+        inner_pool_->set_min_idle(n);
+    }
+
+    // Hold n of max_limit back for GetPriority::HIGH: NORMAL gets, get_n()
+    // and async_get() wait rather than take the last n free resources,
+    // idle or not built yet. Thread-cached resources are exempt. 0
+    // disables.
+    void set_reserved(size_t n) {
+        inner_pool_->set_reserved(n);
+    }
+
+    // Build resources until n are idle, within max_limit, without making
+    // the caller wait: one task per resource on ex so they construct in
+    // parallel, or by the keeper when ex is empty, POLICY::refill_threads
+    // at a time. Returns how many it is building.
+    size_t warm(size_t n, Executor ex = Executor()) {
+        return inner_pool_->warm(n, ex);
+    }
+
+    // Destroy resources idle for longer than ttl, least recently used
+    // first, but leave min_idle of them. The keeper looks a few times per
+    // ttl, so expiry is that coarse. zero() disables.
+    template <class Rep, class Period>
+    void set_idle_ttl(std::chrono::duration<Rep, Period> ttl) {
+        static_assert(POLICY::slot_hooks, "set_idle_ttl() needs a policy with slot_hooks = true");
+        inner_pool_->set_idle_ttl(std::chrono::ceil<Duration>(ttl));
+    }
+
+    // Never hand out or idle again a resource built longer than lifetime
+    // ago; it is destroyed when it comes back, when a get finds it, or
+    // when the keeper reaches it. zero() disables.
+    template <class Rep, class Period>
+    void set_max_lifetime(std::chrono::duration<Rep, Period> lifetime) {
+        static_assert(POLICY::slot_hooks, "set_max_lifetime() needs a policy with slot_hooks = true");
+        inner_pool_->set_max_lifetime(std::chrono::ceil<Duration>(lifetime));
+    }
+
+    size_t size() {
+        return  inner_pool_->total();
+    }
+
+    size_t idle_limit() {
+        return inner_pool_->idle_limit;
+    }
+
+    size_t max_limit() {
+        return inner_pool_->max_limit;
+    }
+
+    // Change the limits at runtime. Growing max_limit serves waiters
+    // straight away; shrinking it never revokes a lease, the keeper
+    // destroys idle resources down to the new limits and returns drain
+    // the rest. Arena storage can't grow past the size it was built with.
+    void resize(size_t idle_limit_, size_t max_limit_) {
+        inner_pool_->resize(idle_limit_, max_limit_);
+    }
+
+    // Let the keeper tune the limits within a's bounds. Every interval
+    // it grows max_limit additively while blocking gets wait longer than
+    // wait_target, and cuts it by a quarter while under half of it is in
+    // use. idle_limit follows the average checked-out count (Little's L),
+    // with more headroom when building a resource costs more than
+    // wait_target. resize() still works and the controller carries on
+    // from there.
+    void set_autosize(const RCPoolAutoSize & a) {
+        inner_pool_->set_autosize(a);
+    }
+
+    // Check a resource before lending it out, on the borrowing thread and
+    // outside cvlock. When fn returns false or throws, the resource is
+    // destroyed, unlocked, and its capacity freed, and the get carries on
+    // with another. every_n checks each resource on every Nth reuse (0:
+    // never by count); a nonzero idle_over also checks any that sat idle
+    // longer than that. Fresh resources are never checked. Set the hooks
+    // before the pool is shared.
+    void set_validate(std::function<bool(INST_T &)> fn, size_t every_n = 1,
+        std::chrono::steady_clock::duration idle_over = std::chrono::steady_clock::duration::zero()) {
+        static_assert(POLICY::slot_hooks, "set_validate() needs a policy with slot_hooks = true");
+        inner_pool_->validate_fn = std::move(fn);
+        inner_pool_->validate_every = every_n;
+        inner_pool_->validate_idle = idle_over;
+    }
+
+    // Run on every resource coming back, on the releasing thread and
+    // outside cvlock; false or a throw discards it like set_validate().
+    void set_reset(std::function<bool(INST_T &)> fn) {
+        inner_pool_->reset_fn = std::move(fn);
+    }
+
+    // Keep resources past idle_limit instead of destroying them, after
+    // fn has released their excess memory (shrink_to_fit, trim an arena);
+    // false or a throw discards it like set_reset(). Runs after the reset
+    // hook on a return that finds idle_limit reached or the pool over its
+    // budget, and on one whose footprint is above shrink_over. Kept ones
+    // still count against max_limit and age out with the idle ttl; with
+    // no ttl nothing would, so then returns keep to idle_limit as without
+    // the hook, and clearing the ttl trims those kept past it.
+    void set_shrink(std::function<bool(INST_T &)> fn, size_t shrink_over = 0) {
+        inner_pool_->shrink_fn = std::move(fn);
+        inner_pool_->shrink_over = shrink_over;
+    }
+
+    // Track the bytes each resource holds through fn, read after it is
+    // built and on every return. With a nonzero budget no more are built
+    // while their sum is at or over it, and returns beyond it are
+    // destroyed unless someone is waiting; max_limit still caps the
+    // count. A soft cap: builds already under way may overshoot it. Set
+    // both hooks before the pool is shared.
+    void set_footprint(std::function<size_t(const INST_T &)> fn, size_t budget = 0) {
+        static_assert(POLICY::slot_hooks, "set_footprint() needs a policy with slot_hooks = true");
+        inner_pool_->footprint_fn = std::move(fn);
+        inner_pool_->budget = budget;
+    }
+
+    // A lease still out, see held_leases(). held is accurate to the
+    // keeper's check interval; stack is the acquiring call stack, one
+    // symbolized frame per entry, for sampled leases only.
+    struct HeldLease {
+        std::chrono::steady_clock::duration held;
+        std::vector<std::string> stack;
+    };
+
+    using HoldReport = std::function<void(const std::vector<HeldLease> &)>;
+
+    // Stamp every lease with a coarse handout time, and keep the
+    // acquiring stack of a sampled few. The keeper looks a few times per
+    // w.threshold and passes report, on its own thread, each lease that
+    // has been out longer than that, once per lease. Stamping costs a
+    // relaxed load and store per get and per put; a sampled one also
+    // takes a backtrace and a side-table lock. Needs a policy with
+    // hold_watch = true.
+    void set_hold_watch(const RCPoolHoldWatch & w, HoldReport report) {
+        static_assert(POLICY::hold_watch, "set_hold_watch() needs a policy with hold_watch = true");
+        inner_pool_->set_hold_watch(w, std::move(report));
+    }
+
+    // every lease out right now while a hold watch is on, longest held
+    // first
+    std::vector<HeldLease> held_leases() {
+        static_assert(POLICY::hold_watch, "held_leases() needs a policy with hold_watch = true");
+        return inner_pool_->held_leases(Duration::zero());
+    }
+
+    // Stop building after b.failures construction failures in a row: for
+    // a backoff window, gets that find nothing idle fail at once with
+    // CIRCUIT_OPEN instead of calling the factory, and refills pause.
+    // When it ends the keeper builds one resource in the background; if
+    // that works the breaker closes, else it opens again for twice as
+    // long, up to b.max_backoff. Idle resources are still handed out
+    // while it is open.
+    void set_breaker(const RCPoolBreaker & b) {
+        inner_pool_->set_breaker(b);
+    }
+
+    bool breaker_open() {
+        return inner_pool_->tripped.load();
+    }
+
+    // summed footprint of the pool's resources, see set_footprint()
+    size_t footprint() {
+        return inner_pool_->bytes.load();
+    }
+
+    // Return the leases this thread has buffered with release_later(),
+    // for every pool of this type, e.g. before the thread goes idle.
+    static void flush_released() {
+        InnerRCPool::release_buffer().flush();
+    }
+
+    // merged over all threads' stripes, RCPoolPolicy::stats only
+    RCPoolStats stats() {
+        static_assert(POLICY::stats, "stats() needs a policy with stats = true");
+        return inner_pool_->collect_stats();
+    }
+
+    // Counts at one instant without taking cvlock or slowing get/put:
+    // total and idle share one atomic word, and the read is retried
+    // until that word holds still across the other fields, as a seqlock
+    // reader does.
+    RCPoolSnapshot snapshot() {
+        return inner_pool_->snapshot();
+    }
+
+    // start the snapshot() high-water marks over from now
+    void reset_peaks() {
+        inner_pool_->reset_peaks();
+    }
+
+    // resources checked out right now, thread caches included
+    size_t in_use() {
+        if constexpr (POLICY::lock_free) {
+            return inner_pool_->in_use();
+        }
+        else {
+            std::lock_guard<std::mutex> lk(inner_pool_->cvlock);
+            return inner_pool_->in_use();
+        }
+    }
+
+    static const char* explain(GetStatus err) {
+        switch (err) {
+            case GetStatus::SUCCESS: return "Success";
+            break;
+            case GetStatus::CTORF: return "Resource construct failed";
+            break;
+            case GetStatus::TIMEOUT: return "Wait resource timeout";
+            break;
+            case GetStatus::UNKNOWN: return "Unknow fialure";
+            break;
+            case GetStatus::CANCELED: return "Wait resource canceled";
+            break;
+            case GetStatus::CIRCUIT_OPEN: return "Resource construct suspended";
+            break;
+        }
+        return "Unknow fialure";
+    }
+
+private:
+    template <class, class> friend class ShardedRCPool;
+    template <class, class, class> friend class KeyedRCPool;
+    friend class RCPoolWatch;
+
+    void watch(RCPoolWatch * w) {
+        inner_pool_->watch(w);
+    }
+
+    void unwatch(RCPoolWatch * w) {
+        inner_pool_->unwatch(w);
+    }
+
+    // ShardedRCPool reports the shard through RCPoolSlotInfo
+    void set_shard(size_t i) {
+        inner_pool_->shard_id = i;
+    }
+
+    // for ShardedRCPool neighbours: an idle resource or TIMEOUT, never
+    // builds or waits
+    GetWrapper try_get_idle(GetPriority prio) {
+        Deadline t0 = inner_pool_->stat_clock();
+        try {
+            Slot * s;
+            do {
+                s = inner_pool_->take_one_idle(prio);
+                if (!s) return { nullptr, nullptr, GetStatus::TIMEOUT };
+            } while (!inner_pool_->borrow_ok(s));
+            inner_pool_->record_get(t0, &s, 1, GetStatus::SUCCESS);
+            return { inner_pool_, s, GetStatus::SUCCESS };
+        }
+        catch (...) {
+            return { nullptr, nullptr, GetStatus::UNKNOWN };
+        }
+    }
+
+    using Deadline = std::chrono::steady_clock::time_point;
+    using Duration = std::chrono::steady_clock::duration;
+
+    static Deadline deadline_after(uint32_t timeout_s) {
+        if (!timeout_s) return Deadline::max();
+        return std::chrono::steady_clock::now() + std::chrono::seconds(timeout_s);
+    }
+
+    template <class Rep, class Period>
+    static Deadline deadline_in(std::chrono::duration<Rep, Period> timeout) {
+        auto now = std::chrono::steady_clock::now();
+        if (timeout <= timeout.zero()) return now;
+        // compare in floating point, huge timeouts overflow nanoseconds
+        if (std::chrono::duration<double>(timeout) >= std::chrono::duration<double>(Deadline::max() - now)) {
+            return Deadline::max();
+        }
+        return now + std::chrono::ceil<std::chrono::steady_clock::duration>(timeout);
+    }
+
+    static constexpr bool arena_storage = std::is_base_of<ArenaStorage, typename POLICY::storage>::value;
+    static constexpr bool bitmap_storage = std::is_same<typename POLICY::storage, BitmapStorage>::value;
+    static constexpr bool args_factory = std::is_same<typename POLICY::factory, ArgsFactory>::value;
+    // BitmapStorage packs slots, only the plain arena pads them to lines
+    static constexpr size_t slot_align = arena_storage && !bitmap_storage ?
+        std::max(ArenaStorage::cache_line, alignof(INST_T)) : alignof(INST_T);
+    // which optional Slot parts the policy needs; TaggedStacks link
+    // through lf_next, the locked idle list through next and prev
+    static constexpr bool slot_prev = !POLICY::lock_free;
+    static constexpr bool slot_lf_next = POLICY::lock_free || (arena_storage && !bitmap_storage);
+
+    // optional Slot parts, empty bases when the policy doesn't use them
+    template <int>
+    struct SlotNone {};
+
+    struct SlotPrev {
+        // locked mode idle list back link
+        Slot * prev = nullptr;
+    };
+
+    struct SlotLfNext {
+        std::atomic<Slot *> lf_next{nullptr};
+    };
+
+    struct SlotInUse {
+        // checked out, plain ArenaStorage
+        bool in_use = false;
+    };
+
+    struct SlotHooks {
+        Deadline born{};
+        // stamped while an idle ttl or idle validation is set
+        Deadline idle_since{};
+        // borrows so far, and the last footprint() reading
+        size_t uses = 0;
+        size_t bytes = 0;
+    };
+
+    struct SlotLent {
+        // handed out, stats policy only
+        Deadline lent{};
+    };
+
+    struct SlotHeld {
+        // hold watch: coarse handout time, 0 while not lent out; traced
+        // while its stack is on file, reported once per lease
+        std::atomic<int64_t> held_since{0};
+        std::atomic<bool> traced{false};
+        std::atomic<bool> reported{false};
+    };
+
+    // one pooled resource, constructed in place; idle slots are chained
+    // through next (locked mode) or lf_next (lock-free mode) so idling
+    // needs no allocation
+    struct Slot :
+        std::conditional<slot_prev, SlotPrev, SlotNone<0>>::type,
+        std::conditional<slot_lf_next, SlotLfNext, SlotNone<1>>::type,
+        std::conditional<arena_storage && !bitmap_storage, SlotInUse, SlotNone<2>>::type,
+        std::conditional<POLICY::slot_hooks, SlotHooks, SlotNone<3>>::type,
+        std::conditional<POLICY::stats, SlotLent, SlotNone<4>>::type,
+        std::conditional<POLICY::hold_watch, SlotHeld, SlotNone<5>>::type
+    {
+        alignas(slot_align) unsigned char raw[sizeof(INST_T)];
+        INST_T * inst = nullptr;
+        Slot * next = nullptr;
+        // failed a validate/reset hook, shrunk on its way back
+        bool broken = false;
+        bool shrunk = false;
+    };
+
+    class InnerRCPool {
+        public:
+        template <class... Args>
+        InnerRCPool(size_t idle_limit_, size_t max_limit_, Args&&... _args) :
+            factory(std::forward<Args>(_args)...)
+        {
+            idle_limit = idle_limit_;
+            // counts share one word, see state
+            max_limit = std::min<size_t>(std::max(idle_limit_, max_limit_), idle_mask);
+            built_max = max_limit;
+            if constexpr (POLICY::stats) {
+                stat_block.reset(new std::array<StatStripe, stat_stripes>());
+            }
+            if constexpr (bitmap_storage) {
+                arena.reset(new Slot[built_max]);
+                vacant.reset(built_max, true);
+                lent.reset(built_max, false);
+            }
+            else if constexpr (arena_storage) {
+                arena.reset(new Slot[built_max]);
+                for (size_t i = built_max; i > 0; i--) {
+                    spare_stack.push(&arena[i - 1]);
+                }
+            }
+        }
+
+        // disallow copy
+        InnerRCPool(const InnerRCPool & rhs) = delete;
+        InnerRCPool & operator=(const InnerRCPool & rhs) = delete;
+
+        // disallow copy
+        InnerRCPool(InnerRCPool && rhs) = delete;
+        InnerRCPool & operator=(InnerRCPool && rhs) = delete;
+
+        ~InnerRCPool() {
+            while (unused) {
+                Slot * n = unused->next;
+                destroy_slot(unused);
+                unused = n;
+            }
+            while (expired) {
+                Slot * n = expired->next;
+                destroy_slot(expired);
+                expired = n;
+            }
+            if constexpr (POLICY::lock_free) {
+                while (Slot * s = idle_stack.pop()) destroy_slot(s);
+                while (Slot * s = expired_stack.pop()) destroy_slot(s);
+                if constexpr (!arena_storage) {
+                    while (Slot * s = spare_stack.pop()) delete s;
+                }
+            }
+        }
+
+        private:
+        friend class RCPool;
+        friend class GetWrapper;
+        friend struct AsyncOp;
+
+        using Factory = typename std::conditional<args_factory,
+            detail::ArgsCreator<INST_T>, typename POLICY::factory>::type;
+
+        // Drop the RCPool's reference. Checked-out slots keep the pool
+        // alive, the put that returns the last one deletes it, so no
+        // per-lease reference count is needed.
+        void retire() {
+            // cancel async gets still queued, the keeper delivers them
+            // before it exits
+            {
+                std::lock_guard<std::mutex> lk(cvlock);
+                for (Waiter * w = waitq_head; w; ) {
+                    Waiter * next = w->next;
+                    if (w->op) async_done(w->op, GetStatus::CANCELED);
+                    w = next;
+                }
+                keeper_stop = true;
+                keeper_cv.notify_one();
+            }
+            if (keeper.joinable()) {
+                keeper.join();
+            }
+
+            // from here on put() destroys instead of idling
+            orphaned = true;
+
+            if constexpr (POLICY::thread_cache > 0) {
+                // reclaim what threads still cache for us
+                std::vector<Slot *> cached;
+                {
+                    std::lock_guard<std::mutex> lk(mags_lock);
+                    for (auto & m : mags) {
+                        std::lock_guard<std::mutex> ml(m->lock);
+                        cached.insert(cached.end(), m->items.begin(), m->items.begin() + m->count);
+                        m->count = 0;
+                        m->pool = nullptr;
+                    }
+                }
+                if (cached.size()) {
+                    central_put(cached.data(), cached.size());
+                }
+            }
+            // and what release buffers hold, so they don't keep us alive
+            reclaim_released();
+
+            bool last;
+            if constexpr (POLICY::lock_free) {
+                last = used_cnt.fetch_or(owner_gone) == 0;
+            }
+            else {
+                std::lock_guard<std::mutex> lk(cvlock);
+                owned = false;
+                last = unreferenced();
+            }
+            if (last) {
+                delete this;
+            }
+        }
+
+        // Per-thread cache of checked-out-but-idle slots for one pool.
+        // Only the owning thread fills it; the pool keeps a reference so
+        // waiters can steal from it and so it can be reclaimed when the
+        // pool goes away. lock is uncontended outside of those two cases.
+        struct Magazine {
+            std::mutex lock;
+            std::array<Slot *, POLICY::thread_cache> items;
+            size_t count = 0;
+            std::atomic<InnerRCPool *> pool{nullptr};
+            std::atomic<bool> dead{false};
+        };
+
+        // a fair mode get() or any async_get() parked in the FIFO, granted
+        // either a slot or a reserved unit of the total to construct into
+        struct Waiter {
+            std::condition_variable cv;
+            Waiter * next = nullptr;
+            Waiter * prev = nullptr;
+            Slot * slot = nullptr;
+            bool granted = false;
+            // queued ahead of NORMAL waiters
+            bool high = false;
+            // async waiters are completed by the keeper instead of cv
+            AsyncOp * op = nullptr;
+        };
+
+        // this thread's magazines, one per live pool it has used
+        struct ThreadCache {
+            uint64_t last_id = 0;
+            Magazine * last = nullptr;
+            std::vector<std::pair<uint64_t, std::shared_ptr<Magazine>>> mags;
+
+            ~ThreadCache() {
+                // thread exit, drain back to the pools
+                for (auto & e : mags) {
+                    Magazine * m = e.second.get();
+                    std::lock_guard<std::mutex> ml(m->lock);
+                    if (m->pool && m->count) {
+                        m->pool.load()->central_put(m->items.data(), m->count);
+                    }
+                    m->count = 0;
+                    m->dead = true;
+                }
+            }
+        };
+
+        // leases this thread gave up with release_later(), for every pool
+        // of this type; flushed when full and at thread exit. Every live
+        // buffer is on the ReleaseBuffers list so a pool's waiters can
+        // take back what an idle thread still holds for it; lock is
+        // uncontended outside of that.
+        struct ReleaseBuffer {
+            std::mutex lock;
+            std::vector<std::pair<InnerRCPool *, Slot *>> items;
+            std::vector<std::pair<InnerRCPool *, Slot *>> spare;
+            std::vector<Slot *> run;
+            ReleaseBuffer * prev = nullptr;
+            ReleaseBuffer * next = nullptr;
+
+            ReleaseBuffer() {
+                ReleaseBuffers & all = release_buffers();
+                std::lock_guard<std::mutex> lk(all.lock);
+                next = all.head;
+                if (next) next->prev = this;
+                all.head = this;
+            }
+
+            ~ReleaseBuffer() {
+                flush();
+                ReleaseBuffers & all = release_buffers();
+                std::lock_guard<std::mutex> lk(all.lock);
+                (prev ? prev->next : all.head) = next;
+                if (next) next->prev = prev;
+            }
+
+            void flush() {
+                {
+                    std::lock_guard<std::mutex> lk(lock);
+                    if (items.empty()) return;
+                    // keep both reservations, put_later() made them
+                    items.swap(spare);
+                }
+                // group by pool, each gets one central_put and is not
+                // touched after it, the last put may free the pool
+                std::sort(spare.begin(), spare.end());
+                for (size_t i = 0; i < spare.size(); ) {
+                    InnerRCPool * p = spare[i].first;
+                    run.clear();
+                    for (; i < spare.size() && spare[i].first == p; i++) {
+                        run.push_back(spare[i].second);
+                    }
+                    p->buffered.fetch_sub(run.size());
+                    for (Slot * s : run) p->reset_on_return(s);
+                    p->central_put(run.data(), run.size());
+                }
+                spare.clear();
+            }
+        };
+
+        struct ReleaseBuffers {
+            std::mutex lock;
+            ReleaseBuffer * head = nullptr;
+        };
+
+        static ReleaseBuffers & release_buffers() {
+            static ReleaseBuffers all;
+            return all;
+        }
+
+        static ReleaseBuffer & release_buffer() {
+            static thread_local ReleaseBuffer rb;
+            return rb;
+        }
+
+        // Deadline::max() waits forever, a passed deadline doesn't wait
+        Slot * inner_get(Deadline deadline, GetPriority prio = GetPriority::NORMAL) {
+            if constexpr (POLICY::thread_cache > 0) {
+                Slot * s = magazine_get();
+                if (s) return s;
+            }
+            else if constexpr (POLICY::lock_free) {
+                // fast path, no lock while an idle resource exists
+                Slot * s = resource_available(prio) ? pop_idle() : nullptr;
+                if (s) {
+                    lend(&s, 1);
+                    if (below_min_idle(0) && !refill_pending.load()) {
+                        std::lock_guard<std::mutex> lk(cvlock);
+                        request_refill();
+                    }
+                    return s;
+                }
+            }
+
+            if constexpr (POLICY::thread_cache == 0) {
+                // nothing idle and no room, try_get() fails without cvlock
+                // unless another thread has some buffered
+                if (deadline == Deadline::min() && !resource_available(prio)) {
+                    Slot * s = nullptr;
+                    reclaim_released(&s);
+                    if (s) return s;
+                    if (!resource_available(prio)) {
+                        throw detail::ResourceTimedoutException("Timedout");
+                    }
+                }
+                // about to wait, maybe for one this thread has buffered
+                if (!resource_available(prio)) {
+                    flush_own_released();
+                }
+            }
+
+            std::unique_lock<std::mutex> uq_cvlock = lock_pool();
+            if (below_min_idle(1)) {
+                request_refill();
+            }
+
+            if constexpr (POLICY::fair) {
+                // NORMAL gets queue behind anyone, HIGH ones behind HIGH ones
+                bool queued = prio == GetPriority::HIGH ? high_waiters.load() != 0 : waitq_head != nullptr;
+                if (queued || !resource_available(prio)) {
+                    bool create = false;
+                    Slot * s = wait_turn(uq_cvlock, deadline, create, prio);
+                    if (!create) return s;
+                    // granted a reserved unit of the total to construct into
+                    return create_reserved(uq_cvlock);
+                }
+            }
+
+            if constexpr (POLICY::lock_free) {
+                for (;;) {
+                    Slot * s = wait_available(uq_cvlock, deadline, prio);
+                    if (s) return s;
+
+                    // a fast path caller may have raced us to the idle one
+                    s = pop_idle();
+                    if (s) {
+                        lend(&s, 1);
+                        return s;
+                    }
+                    if (total() < cap()) break;
+                }
+            }
+            else {
+                for (;;) {
+                    Slot * s = wait_available(uq_cvlock, deadline, prio);
+                    if (s) return s;
+
+                    s = pop_idle();
+                    if (s) {
+                        try {
+                            track_out(s);
+                        }
+                        catch (...) {
+                            push_idle(s);
+                            throw;
+                        }
+                        return s;
+                    }
+                    // the idle ones were past max_lifetime, set aside
+                    if (total() < cap()) break;
+                }
+            }
+
+            // nothing idle, and the factory keeps failing
+            if (tripped.load()) {
+                throw detail::ResourceUnavailableException("Circuit open");
+            }
+
+            // reserve a slot, then construct without holding cvlock so a
+            // slow factory doesn't stall other get()/put() callers
+            add_total(1);
+            return create_reserved(uq_cvlock);
+        }
+
+        // construct into a unit of the total already reserved, unlocked
+        Slot * create_reserved(std::unique_lock<std::mutex> & uq_cvlock) {
+            uq_cvlock.unlock();
+
+            Slot * s = create_slot();
+
+            // publish
+            if constexpr (POLICY::lock_free) {
+                lend(&s, 1);
+            }
+            else {
+                uq_cvlock.lock();
+                try {
+                    track_out(s);
+                }
+                catch (...) {
+                    uq_cvlock.unlock();
+                    destroy_slot(s);
+                    cancel_reservation();
+                    throw;
+                }
+            }
+
+            return s;
+        }
+
+        // returns a slot stolen from a thread cache instead of waiting, or
+        // nullptr once resource_available() holds
+        Slot * wait_available(std::unique_lock<std::mutex> & uq_cvlock, Deadline deadline, GetPriority prio) {
+            if (resource_available(prio)) return nullptr;
+
+            bool high = prio == GetPriority::HIGH;
+            Deadline t0 = wait_clock();
+            waiters++;
+            if (high) high_waiters++;
+            if constexpr (POLICY::thread_cache > 0) {
+                // magazines stop filling once waiters is raised, so only
+                // what they hold right now can be stranded
+                if (!resource_available(prio)) {
+                    uq_cvlock.unlock();
+                    Slot * s = magazine_steal();
+                    uq_cvlock.lock();
+                    if (s) {
+                        waiters--;
+                        if (high) leave_high();
+                        return s;
+                    }
+                }
+            }
+            else if constexpr (POLICY::release_batch > 0) {
+                // likewise release buffers stop holding on once waiters
+                // is raised
+                if (!resource_available(prio)) {
+                    uq_cvlock.unlock();
+                    Slot * s = nullptr;
+                    reclaim_released(&s);
+                    uq_cvlock.lock();
+                    if (s) {
+                        waiters--;
+                        if (high) leave_high();
+                        return s;
+                    }
+                }
+            }
+            while (!resource_available(prio)) {
+                if (!wait_step(uq_cvlock, deadline) && !resource_available(prio)) {
+                    waiters--;
+                    if (high) leave_high();
+                    note_wait(t0);
+                    throw detail::ResourceTimedoutException("Timedout");
+                }
+            }
+            waiters--;
+            if (high) leave_high();
+            note_wait(t0);
+            return nullptr;
+        }
+
+        // under cvlock, a HIGH get stopped waiting; let the NORMAL ones
+        // that held back for it look again
+        void leave_high() {
+            if (--high_waiters) return;
+            serve_waiters();
+            cv.notify_all();
+        }
+
+        // fair mode: queue up and sleep until served. Returns the slot
+        // handed over, or nullptr with create set when granted capacity.
+        Slot * wait_turn(std::unique_lock<std::mutex> & uq_cvlock, Deadline deadline, bool & create, GetPriority prio) {
+            Deadline t0 = wait_clock();
+            waiters++;
+            if constexpr (POLICY::thread_cache > 0) {
+                if (!waitq_head) {
+                    uq_cvlock.unlock();
+                    Slot * s = magazine_steal();
+                    uq_cvlock.lock();
+                    if (s) {
+                        waiters--;
+                        return s;
+                    }
+                }
+            }
+            else if constexpr (POLICY::release_batch > 0) {
+                if (!waitq_head) {
+                    uq_cvlock.unlock();
+                    Slot * s = nullptr;
+                    reclaim_released(&s);
+                    uq_cvlock.lock();
+                    if (s) {
+                        waiters--;
+                        return s;
+                    }
+                }
+            }
+
+            Waiter w;
+            w.high = prio == GetPriority::HIGH;
+            link_waiter(&w);
+            // things may have freed up while cvlock was dropped
+            serve_waiters();
+
+            while (!w.granted) {
+                if (!wait_step(uq_cvlock, deadline, w.cv) && !w.granted) {
+                    unlink_waiter(&w);
+                    if (w.high && !high_waiters) {
+                        // NORMAL waiters were held back for it
+                        serve_waiters();
+                        cv.notify_all();
+                    }
+                    waiters--;
+                    note_wait(t0);
+                    throw detail::ResourceTimedoutException("Timedout");
+                }
+            }
+            waiters--;
+            note_wait(t0);
+            create = !w.slot;
+            return w.slot;
+        }
+
+        // FIFO within a priority, HIGH waiters ahead of NORMAL ones
+        void link_waiter(Waiter * w) {
+            Waiter * after = waitq_tail;
+            if (w->high) {
+                high_waiters++;
+                after = nullptr;
+                for (Waiter * q = waitq_head; q && q->high; q = q->next) {
+                    after = q;
+                }
+            }
+            w->prev = after;
+            w->next = after ? after->next : waitq_head;
+            (w->next ? w->next->prev : waitq_tail) = w;
+            (after ? after->next : waitq_head) = w;
+        }
+
+        void unlink_waiter(Waiter * w) {
+            (w->prev ? w->prev->next : waitq_head) = w->next;
+            (w->next ? w->next->prev : waitq_tail) = w->prev;
+            if (w->high) high_waiters--;
+        }
+
+        // under cvlock: hand whatever is free to queued waiters in
+        // arrival order, waking only those served. Outside fair mode only
+        // async gets queue here.
+        void serve_waiters() {
+            while (waitq_head) {
+                // a NORMAL head leaves the reserve to HIGH gets
+                if (!resource_available(waitq_head->high ? GetPriority::HIGH : GetPriority::NORMAL)) break;
+                Slot * s = nullptr;
+                if (!take_idle(&s, 1)) {
+                    if (total() >= cap()) break;
+                    add_total(1);
+                }
+                Waiter * w = waitq_head;
+                unlink_waiter(w);
+                w->slot = s;
+                w->granted = true;
+                if (w->op) {
+                    async_done(w->op, GetStatus::SUCCESS);
+                }
+                else {
+                    // w lives on its owner's stack, still parked on cvlock
+                    w->cv.notify_one();
+                }
+            }
+            // acquire_all() callers take for themselves
+            for (RCPoolWatch * w : watches) {
+                w->poke();
+            }
+        }
+
+        // An acquire_all() waiting here among other pools. It counts as
+        // a waiter so releases take the paths that serve_waiters().
+        void watch(RCPoolWatch * w) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            watches.push_back(w);
+            waiters++;
+        }
+
+        void unwatch(RCPoolWatch * w) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            auto it = std::find(watches.begin(), watches.end(), w);
+            if (it == watches.end()) return;
+            watches.erase(it);
+            waiters--;
+        }
+
+        // keep the pool allocated for an AsyncOp, like a checked-out slot
+        void pin() {
+            if constexpr (POLICY::lock_free) {
+                used_cnt++;
+            }
+            else {
+                std::lock_guard<std::mutex> lk(cvlock);
+                pins++;
+            }
+        }
+
+        void unpin() {
+            if constexpr (POLICY::lock_free) {
+                if (used_cnt.fetch_sub(1) == (owner_gone | 1)) {
+                    delete this;
+                }
+            }
+            else {
+                bool last;
+                {
+                    std::lock_guard<std::mutex> lk(cvlock);
+                    pins--;
+                    last = unreferenced();
+                }
+                if (last) {
+                    delete this;
+                }
+            }
+        }
+
+        // serve op right away if something is free and nobody is queued,
+        // else queue it for serve_waiters() or its deadline
+        void async_start(const std::shared_ptr<AsyncOp> & op) {
+            if (!op->pinned) {
+                pin();
+                op->pinned = true;
+            }
+
+            Slot * s = nullptr;
+            if constexpr (POLICY::thread_cache > 0) {
+                s = magazine_get();
+            }
+
+            std::unique_lock<std::mutex> uq_cvlock = lock_pool();
+            if (!s && !op->done && !waitq_head && resource_available()) {
+                if (!take_idle(&s, 1) && total() < cap()) {
+                    add_total(1);
+                    op->create = true;
+                }
+            }
+            if (!s && !op->create && !op->done) {
+                waiters++;
+                if constexpr (POLICY::thread_cache > 0) {
+                    if (!waitq_head) {
+                        uq_cvlock.unlock();
+                        s = magazine_steal();
+                        uq_cvlock.lock();
+                    }
+                }
+                else if constexpr (POLICY::release_batch > 0) {
+                    if (!waitq_head) {
+                        uq_cvlock.unlock();
+                        reclaim_released(&s);
+                        uq_cvlock.lock();
+                    }
+                }
+                if (!s && op->deadline > std::chrono::steady_clock::now()) {
+                    try {
+                        start_keeper();
+                        queue_async(op);
+                        return;
+                    }
+                    catch (...) {
+                        op->status = GetStatus::UNKNOWN;
+                    }
+                }
+                else if (!s) {
+                    op->status = GetStatus::TIMEOUT;
+                }
+                waiters--;
+            }
+            op->slot = s;
+            op->done = true;
+            uq_cvlock.unlock();
+            dispatch(op);
+        }
+
+        // under cvlock, op pending with waiters already raised
+        void queue_async(const std::shared_ptr<AsyncOp> & op) {
+            if (op->deadline != Deadline::max()) {
+                op->timer = timers.emplace(op->deadline, op.get());
+                op->timed = true;
+            }
+            Waiter * w = &op->node;
+            w->op = op.get();
+            link_waiter(w);
+            op->queued = true;
+            op->self = op;
+            keeper_cv.notify_one();
+            // things may have freed up while cvlock was dropped
+            serve_waiters();
+        }
+
+        // under cvlock: finish a queued async get, granted by
+        // serve_waiters() or failed with st, and hand it to the keeper
+        void async_done(AsyncOp * op, GetStatus st) {
+            Waiter * w = &op->node;
+            if (w->granted) {
+                op->slot = w->slot;
+                op->create = !w->slot;
+            }
+            else {
+                unlink_waiter(w);
+            }
+            waiters--;
+            if (op->timed) {
+                timers.erase(op->timer);
+                op->timed = false;
+            }
+            op->status = st;
+            op->queued = false;
+            op->done = true;
+            op->ready_next = nullptr;
+            (ready_tail ? ready_tail->ready_next : ready_head) = op;
+            ready_tail = op;
+            keeper_cv.notify_one();
+        }
+
+        // under cvlock
+        void start_keeper() {
+            if (!keeper.joinable()) {
+                keeper = std::thread([this]() { keeper_loop(); });
+            }
+        }
+
+        // Pool housekeeping thread: expires async gets at their deadline
+        // and delivers completed ones to their executors without holding
+        // cvlock. Runs until retire().
+        void keeper_loop() {
+            std::unique_lock<std::mutex> uq_cvlock(cvlock);
+            for (;;) {
+                auto now = std::chrono::steady_clock::now();
+                while (!timers.empty() && timers.begin()->first <= now) {
+                    async_done(timers.begin()->second, GetStatus::TIMEOUT);
+                }
+
+                if (ready_head) {
+                    AsyncOp * op = ready_head;
+                    ready_head = ready_tail = nullptr;
+                    uq_cvlock.unlock();
+                    while (op) {
+                        AsyncOp * next = op->ready_next;
+                        // may drop the last reference, which takes cvlock
+                        std::shared_ptr<AsyncOp> p = std::move(op->self);
+                        dispatch(p);
+                        op = next;
+                    }
+                    uq_cvlock.lock();
+                    continue;
+                }
+
+                if (refill_pending) {
+                    size_t short_n = refill_shortfall();
+                    if (!keeper_stop && !orphaned && short_n) {
+                        // a round of at most refill_threads, in parallel,
+                        // so completions wait for about one construction
+                        size_t n = std::min<size_t>(short_n, std::max<size_t>(POLICY::refill_threads, 1));
+                        add_total(n);
+                        uq_cvlock.unlock();
+                        bool built = build_round(n);
+                        uq_cvlock.lock();
+                        if (!built) {
+                            // retried on the next trigger
+                            refill_pending = false;
+                            warm_goal = 0;
+                        }
+                        continue;
+                    }
+                    refill_pending = false;
+                    warm_goal = 0;
+                }
+
+                if (!keeper_stop && probe_pending && now >= probe_at) {
+                    probe_pending = false;
+                    probe(uq_cvlock);
+                    continue;
+                }
+
+                if (!keeper_stop && autosizing.load() && now >= next_autosize) {
+                    next_autosize = now + autosize.interval;
+                    autosize_step();
+                    continue;
+                }
+
+                if constexpr (POLICY::hold_watch) {
+                    if (!keeper_stop && hold_watching.load() && now >= next_hold_check) {
+                        next_hold_check = now + hold_interval();
+                        check_holds(uq_cvlock, now);
+                        continue;
+                    }
+                }
+
+                bool reaping = idle_ttl.load() != Duration::zero() || max_lifetime.load() != Duration::zero();
+                if (!keeper_stop && (have_expired() || trim_pending || (reaping && now >= next_reap))) {
+                    next_reap = now + reap_interval();
+                    reap(uq_cvlock, now);
+                    continue;
+                }
+
+                if (keeper_stop) return;
+                // by value, a timer entry may go while we sleep
+                Deadline next = timers.empty() ? Deadline::max() : timers.begin()->first;
+                if (reaping) {
+                    next = std::min(next, next_reap);
+                }
+                if (autosizing.load()) {
+                    next = std::min(next, next_autosize);
+                }
+                if (probe_pending) {
+                    next = std::min(next, probe_at);
+                }
+                if (hold_watching.load()) {
+                    next = std::min(next, next_hold_check);
+                }
+                if (next == Deadline::max()) {
+                    keeper_cv.wait(uq_cvlock);
+                }
+                else {
+                    keeper_cv.wait_until(uq_cvlock, next);
+                }
+            }
+        }
+
+        // Idle slots, most recently used first: unused in locked mode,
+        // where callers hold cvlock, idle_stack in lock-free mode.
+        void push_idle(Slot * s) {
+            if constexpr (POLICY::slot_hooks) {
+                if (idle_ttl.load(std::memory_order_relaxed) != Duration::zero() || validate_idle != Duration::zero()) {
+                    s->idle_since = std::chrono::steady_clock::now();
+                }
+            }
+            state.fetch_add(1);
+            if constexpr (POLICY::lock_free) {
+                idle_stack.push(s);
+                // after the push, so a reap that missed it still sees it
+                if constexpr (POLICY::slot_hooks) {
+                    Duration ttl = idle_ttl.load(std::memory_order_relaxed);
+                    Duration lt = max_lifetime.load(std::memory_order_relaxed);
+                    if (ttl != Duration::zero() || lt != Duration::zero()) {
+                        lower_idle_due(slot_due(s, ttl, lt));
+                    }
+                }
+            }
+            else {
+                s->prev = nullptr;
+                s->next = unused;
+                (unused ? unused->prev : unused_tail) = s;
+                unused = s;
+            }
+        }
+
+        // slots past max_lifetime are set aside for the keeper to destroy
+        // rather than handed out
+        Slot * pop_idle() {
+            for (;;) {
+                Slot * s;
+                if constexpr (POLICY::lock_free) {
+                    s = idle_stack.pop();
+                }
+                else {
+                    s = unused;
+                    if (s) unlink_idle(s);
+                }
+                if (!s) return nullptr;
+                note_peaks(state.fetch_sub(1) - 1);
+                if (!past_lifetime(s)) return s;
+
+                if constexpr (POLICY::lock_free) {
+                    expired_stack.push(s);
+                }
+                else {
+                    s->next = expired;
+                    expired = s;
+                }
+                // unlocked in lock-free mode: a lost wakeup only waits
+                // for the next reap tick
+                keeper_cv.notify_one();
+            }
+        }
+
+        void unlink_idle(Slot * s) {
+            (s->prev ? s->prev->next : unused) = s->next;
+            (s->next ? s->next->prev : unused_tail) = s->prev;
+        }
+
+        bool past_lifetime(Slot * s) {
+            if constexpr (POLICY::slot_hooks) {
+                Duration lt = max_lifetime.load(std::memory_order_relaxed);
+                return lt != Duration::zero() && std::chrono::steady_clock::now() - s->born >= lt;
+            }
+            else {
+                return false;
+            }
+        }
+
+        // idle since before the ttl was set counts from now
+        bool past_idle_ttl(Slot * s, Deadline now, Duration ttl) {
+            if constexpr (POLICY::slot_hooks) {
+                if (s->idle_since == Deadline()) {
+                    s->idle_since = now;
+                }
+                return now - s->idle_since >= ttl;
+            }
+            else {
+                return false;
+            }
+        }
+
+        // when s comes up for reaping, Deadline::max() for never
+        Deadline slot_due(Slot * s, Duration ttl, Duration lt) {
+            Deadline due = Deadline::max();
+            if constexpr (POLICY::slot_hooks) {
+                if (ttl != Duration::zero()) due = s->idle_since + ttl;
+                if (lt != Duration::zero()) due = std::min(due, s->born + lt);
+            }
+            return due;
+        }
+
+        void lower_idle_due(Deadline due) {
+            Deadline cur = idle_due.load(std::memory_order_relaxed);
+            while (due < cur && !idle_due.compare_exchange_weak(cur, due)) {}
+        }
+
+        // under cvlock
+        bool have_expired() {
+            if constexpr (POLICY::lock_free) {
+                return !expired_stack.empty();
+            }
+            else {
+                return expired != nullptr;
+            }
+        }
+
+        // a few checks per ttl or lifetime, within [10ms, 1s]
+        Duration reap_interval() {
+            Duration ttl = idle_ttl.load();
+            Duration lt = max_lifetime.load();
+            Duration d = ttl == Duration::zero() ? lt : lt == Duration::zero() ? ttl : std::min(ttl, lt);
+            return std::min<Duration>(std::max<Duration>(d / 4, std::chrono::milliseconds(10)), std::chrono::seconds(1));
+        }
+
+        // Keeper, under cvlock: destroy the idle slots past idle_ttl,
+        // least recently used first and leaving min_idle, plus those past
+        // max_lifetime and, after a shrink, those over the limits. cvlock
+        // is dropped while destroying.
+        void reap(std::unique_lock<std::mutex> & uq_cvlock, Deadline now) {
+            Duration ttl = idle_ttl.load();
+            Slot * doomed = nullptr;
+            size_t n = 0;
+            auto doom = [&](Slot * s) {
+                s->next = doomed;
+                doomed = s;
+                n++;
+            };
+
+            if constexpr (POLICY::lock_free) {
+                while (Slot * s = expired_stack.pop()) doom(s);
+            }
+            else {
+                while (expired) {
+                    Slot * s = expired;
+                    expired = s->next;
+                    doom(s);
+                }
+            }
+
+            size_t busy = in_use() + n;
+            size_t total_n = total();
+            size_t idle = total_n > busy ? total_n - busy : 0;
+            size_t keep = min_idle.load();
+
+            // idle ones beyond what resize() left room for, oldest first
+            size_t excess = 0;
+            if (trim_pending) {
+                trim_pending = false;
+                size_t limit = std::min<size_t>(max_limit, std::max({idle_limit.load(), busy - n, keep}));
+                excess = total_n - n > limit ? std::min(total_n - n - limit, idle) : 0;
+            }
+
+            if constexpr (POLICY::lock_free) {
+                // a lock-free stack can only be reaped from the top, so
+                // take it all and put the survivors back oldest first,
+                // but only once idle_due says one may be due. The taken
+                // stay counted idle, so a get finding the stack empty
+                // meanwhile waits for cvlock rather than failing.
+                if (excess || now >= idle_due.load()) {
+                    idle_due = Deadline::max();
+                    Duration lt = max_lifetime.load();
+                    Deadline due = Deadline::max();
+                    Slot * live = nullptr;
+                    size_t seen = 0;
+                    while (Slot * s = idle_stack.pop()) {
+                        // newest first, the first keep are safe from the ttl
+                        bool stale = ttl != Duration::zero() && past_idle_ttl(s, now, ttl);
+                        if ((stale && seen >= keep) || past_lifetime(s)) {
+                            state.fetch_sub(1);
+                            doom(s);
+                            continue;
+                        }
+                        // stale ones kept for min_idle come due again with
+                        // a newer one, or with set_min_idle()
+                        if (!stale) due = std::min(due, slot_due(s, ttl, lt));
+                        s->next = live;
+                        live = s;
+                        seen++;
+                    }
+                    while (live) {
+                        Slot * s = live;
+                        live = s->next;
+                        if (excess) {
+                            excess--;
+                            state.fetch_sub(1);
+                            doom(s);
+                            continue;
+                        }
+                        idle_stack.push(s);
+                    }
+                    lower_idle_due(due);
+                }
+            }
+            else {
+                // unused is most recently used first, expiry runs from the tail
+                while (unused_tail) {
+                    Slot * s = unused_tail;
+                    bool stale = ttl != Duration::zero() && idle > keep && past_idle_ttl(s, now, ttl);
+                    if (!excess && !stale && !past_lifetime(s)) break;
+                    if (excess) excess--;
+                    unlink_idle(s);
+                    state.fetch_sub(1);
+                    doom(s);
+                    if (idle) idle--;
+                }
+            }
+            if (!n) return;
+
+            // still counted in the total, and the keeper is joined before the
+            // pool can go, so nothing else needs to pin it
+            uq_cvlock.unlock();
+            while (doomed) {
+                Slot * s = doomed;
+                doomed = s->next;
+                destroy_slot(s);
+            }
+            uq_cvlock.lock();
+            sub_total(n);
+            serve_waiters();
+            notify(n);
+            if (below_min_idle(0)) {
+                request_refill();
+            }
+        }
+
+        void set_idle_ttl(Duration ttl) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            idle_ttl = std::max(ttl, Duration::zero());
+            idle_due = Deadline();
+            start_keeper();
+            // shrunk ones kept past idle_limit would never go now
+            if (idle_ttl.load() == Duration::zero() && total() > std::max<size_t>(idle_limit, in_use())) {
+                trim_pending = true;
+            }
+            keeper_cv.notify_one();
+        }
+
+        void set_max_lifetime(Duration lifetime) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            max_lifetime = std::max(lifetime, Duration::zero());
+            idle_due = Deadline();
+            start_keeper();
+            keeper_cv.notify_one();
+        }
+
+        void resize(size_t idle_n, size_t max_n) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            apply_limits(idle_n, max_n);
+        }
+
+        // under cvlock, like the constructor max_limit is at least idle_n
+        void apply_limits(size_t idle_n, size_t max_n) {
+            size_t cap = arena_storage ? built_max : static_cast<size_t>(idle_mask);
+            max_n = std::min(std::max(idle_n, max_n), cap);
+            idle_n = std::min(idle_n, max_n);
+            size_t old = max_limit;
+            idle_limit = idle_n;
+            max_limit = max_n;
+            min_idle = std::min<size_t>(min_idle, max_n);
+            reserved = std::min<size_t>(reserved, max_n);
+            if (max_n > old) {
+                serve_waiters();
+                cv.notify_all();
+            }
+            if (total() > std::max(idle_n, in_use())) {
+                // no keeper, no trim: returns still drain to the limits
+                try {
+                    start_keeper();
+                }
+                catch (...) {
+                    return;
+                }
+                trim_pending = true;
+                keeper_cv.notify_one();
+            }
+        }
+
+        void set_autosize(const RCPoolAutoSize & a) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            size_t cap = arena_storage ? built_max : static_cast<size_t>(idle_mask);
+            RCPoolAutoSize b = a;
+            b.max_limit = std::min(b.max_limit ? b.max_limit : built_max, cap);
+            b.min_limit = std::min(std::max<size_t>(b.min_limit, 1), b.max_limit);
+            if (b.interval <= b.interval.zero()) {
+                autosizing = false;
+                return;
+            }
+            start_keeper();
+            autosize = b;
+            load_avg = static_cast<double>(in_use());
+            build_avg_ns = 0;
+            slow_waits = 0;
+            build_ns = 0;
+            builds = 0;
+            next_autosize = std::chrono::steady_clock::now() + b.interval;
+            autosizing = true;
+            keeper_cv.notify_one();
+        }
+
+        // Keeper, under cvlock: one controller step. Additive increase
+        // while gets queue, multiplicative decrease while under half of
+        // max_limit is used, idle_limit tracking the average load.
+        void autosize_step() {
+            size_t slow = slow_waits.exchange(0);
+            uint64_t n = builds.exchange(0);
+            uint64_t ns = build_ns.exchange(0);
+            if (n) {
+                double avg = static_cast<double>(ns) / n;
+                build_avg_ns = build_avg_ns ? build_avg_ns * 0.75 + avg * 0.25 : avg;
+            }
+            size_t busy = in_use();
+            load_avg = load_avg * 0.75 + busy * 0.25;
+
+            size_t cur = max_limit;
+            size_t next = cur;
+            if (slow) {
+                next = cur + std::min(slow, std::max<size_t>(1, cur / 4));
+            }
+            else if (std::max<double>(busy, load_avg) * 2 < cur) {
+                next = cur - cur / 4;
+            }
+            next = std::min(std::max(next, autosize.min_limit), autosize.max_limit);
+
+            // Little's L, the average checked-out count, plus headroom,
+            // more of it when building a resource makes a get wait
+            double wait_ns = static_cast<double>(std::chrono::nanoseconds(autosize.wait_target).count());
+            double headroom = build_avg_ns > wait_ns ? 1.5 : 1.25;
+            size_t idle = static_cast<size_t>(std::ceil(load_avg * headroom));
+            idle = std::min(std::max(idle, autosize.min_limit), next);
+
+            if (next != cur || idle != idle_limit) {
+                apply_limits(idle, next);
+            }
+        }
+
+        // start of a blocking wait when the controller wants to know
+        Deadline wait_clock() {
+            return autosizing.load(std::memory_order_relaxed) ? std::chrono::steady_clock::now() : Deadline();
+        }
+
+        // under cvlock
+        void note_wait(Deadline t0) {
+            if (t0 == Deadline()) return;
+            if (std::chrono::steady_clock::now() - t0 > autosize.wait_target) {
+                slow_waits.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        Deadline build_clock() {
+            if (POLICY::stats || autosizing.load(std::memory_order_relaxed)) {
+                return std::chrono::steady_clock::now();
+            }
+            return Deadline();
+        }
+
+        // n resources built in [t0, t1]
+        void note_build(Deadline t0, Deadline t1, size_t n) {
+            if (t0 == Deadline() || !n || !autosizing.load(std::memory_order_relaxed)) return;
+            uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+            build_ns.fetch_add(ns, std::memory_order_relaxed);
+            builds.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // checked-out slots, thread caches included
+        size_t in_use() {
+            if constexpr (POLICY::lock_free) {
+                return used_cnt.load() & ~owner_gone;
+            }
+            else {
+                return used_size();
+            }
+        }
+
+        // idle count minus taking short of the refill target; locked
+        // mode callers hold cvlock
+        // under cvlock, how many the keeper should build to bring the
+        // idle count up to min_idle or warm_goal, within cap()
+        size_t refill_shortfall() {
+            size_t want = std::max(min_idle.load(), warm_goal.load());
+            if (!want) return 0;
+            size_t busy = in_use();
+            size_t total_n = total();
+            size_t max_n = cap();
+            if (total_n >= busy + want || total_n >= max_n) return 0;
+            return std::min(busy + want - total_n, max_n - total_n);
+        }
+
+        bool below_min_idle(size_t taking) {
+            size_t want = std::max(min_idle.load(), warm_goal.load());
+            if (!want) return false;
+            size_t busy = in_use() + taking;
+            return total() < busy + want;
+        }
+
+        // under cvlock, have the keeper top the idle count up
+        void request_refill() {
+            if (refill_pending) return;
+            try {
+                start_keeper();
+            }
+            catch (...) {
+                return;
+            }
+            refill_pending = true;
+            keeper_cv.notify_one();
+        }
+
+        void set_min_idle(size_t n) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            min_idle = std::min<size_t>(n, max_limit);
+            idle_due = Deadline();
+            if (below_min_idle(0)) {
+                request_refill();
+            }
+        }
+
+        // construct into a reserved unit of the total and idle it, false if
+        // the factory failed; a probe builds while the breaker is open
+        bool build_idle(bool probe = false) {
+            Slot * s;
+            try {
+                s = create_slot(probe);
+            }
+            catch (...) {
+                return false;
+            }
+            if constexpr (POLICY::lock_free) {
+                push_idle(s);
+                if (waiters.load()) {
+                    {
+                        std::lock_guard<std::mutex> lk(cvlock);
+                        serve_waiters();
+                    }
+                    notify(1);
+                }
+            }
+            else {
+                std::lock_guard<std::mutex> lk(cvlock);
+                push_idle(s);
+                serve_waiters();
+                notify(1);
+            }
+            return true;
+        }
+
+        // Keeper: n reserved resources built and idled, n - 1 of them on
+        // threads of their own (here too if one can't be started); false
+        // if any failed.
+        bool build_round(size_t n) {
+            std::atomic<bool> ok{true};
+            std::vector<std::thread> ts;
+            size_t started = 0;
+            try {
+                ts.reserve(n - 1);
+                for (; started + 1 < n; started++) {
+                    ts.emplace_back([this, &ok] {
+                        if (!build_idle()) ok = false;
+                    });
+                }
+            }
+            catch (...) {}
+            for (size_t i = started; i < n; i++) {
+                if (!build_idle()) ok = false;
+            }
+            for (auto & t : ts) t.join();
+            return ok;
+        }
+
+        // one warm() resource for a user executor; holds its reservation
+        // and a pin on the pool until it runs or the executor drops it
+        struct WarmJob {
+            explicit WarmJob(InnerRCPool * p) : pool(p) {
+                pool->pin();
+            }
+
+            // disallow copy
+            WarmJob(const WarmJob & rhs) = delete;
+            WarmJob & operator=(const WarmJob & rhs) = delete;
+
+            ~WarmJob() {
+                if (reserved) {
+                    pool->cancel_reservation();
+                }
+                pool->unpin();
+            }
+
+            void run() {
+                if (!reserved) return;
+                reserved = false;
+                if (pool->orphaned) {
+                    pool->cancel_reservation();
+                    return;
+                }
+                pool->build_idle();
+            }
+
+            InnerRCPool * pool;
+            bool reserved = true;
+        };
+
+        size_t warm(size_t n, const Executor & ex) {
+            size_t k;
+            {
+                std::lock_guard<std::mutex> lk(cvlock);
+                size_t busy = in_use();
+                size_t total_n = total();
+                size_t idle = total_n > busy ? total_n - busy : 0;
+                k = idle < n ? std::min(n - idle, room()) : 0;
+                if (!k) return 0;
+                if (!ex) {
+                    warm_goal = std::max(warm_goal.load(), std::min<size_t>(n, max_limit));
+                    request_refill();
+                    return k;
+                }
+                add_total(k);
+            }
+
+            for (size_t i = 0; i < k; i++) {
+                std::shared_ptr<WarmJob> job;
+                try {
+                    job = std::make_shared<WarmJob>(this);
+                }
+                catch (...) {
+                    cancel_reservation(k - i);
+                    return i;
+                }
+                try {
+                    ex([job]() { job->run(); });
+                }
+                catch (...) {
+                    // dropping job gives its reservation back
+                }
+            }
+            return k;
+        }
+
+        // run op's completion on its executor, here if it has none or
+        // refuses the task
+        static void dispatch(const std::shared_ptr<AsyncOp> & op) {
+            if (op->ex) {
+                try {
+                    op->ex([op]() { op->run(); });
+                    return;
+                }
+                catch (...) {}
+            }
+            op->run();
+        }
+
+        // one cv wait bounded by deadline, false once it has passed; a
+        // deadline already passed returns without touching cv
+        bool wait_step(std::unique_lock<std::mutex> & uq_cvlock, Deadline deadline) {
+            return wait_step(uq_cvlock, deadline, cv);
+        }
+
+        bool wait_step(std::unique_lock<std::mutex> & uq_cvlock, Deadline deadline, std::condition_variable & c) {
+            if (deadline == Deadline::max()) {
+                c.wait(uq_cvlock);
+                return true;
+            }
+            return deadline > std::chrono::steady_clock::now() &&
+                c.wait_until(uq_cvlock, deadline) == std::cv_status::no_timeout;
+        }
+
+        // build a resource for a slot already reserved in the total, unlocked
+        Slot * create_slot(bool probe = false) {
+            if (tripped.load() && !probe) {
+                cancel_reservation();
+                throw detail::ResourceUnavailableException("Circuit open");
+            }
+            Slot * s = nullptr;
+            try {
+                s = new_slot();
+                Deadline t0 = build_clock();
+                if constexpr (args_factory) {
+                    s->inst = factory(s->raw);
+                }
+                else {
+                    s->inst = factory.create(static_cast<void *>(s->raw), slot_info(s));
+                }
+                Deadline now = std::chrono::steady_clock::now();
+                if constexpr (POLICY::slot_hooks) {
+                    s->born = now;
+                    s->uses = 0;
+                }
+                s->broken = false;
+                account(s);
+                if constexpr (POLICY::stats) {
+                    stripe().construct.add(now - t0);
+                }
+                note_build(t0, now, 1);
+            }
+            catch (const std::exception & e) {
+                if constexpr (POLICY::stats) {
+                    stripe().ctor_failures.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (s) destroy_slot(s);
+                cancel_reservation();
+                note_build_failed();
+                // wrap throw
+                throw detail::GenericResourceException(e.what());
+            }
+            catch (...) {
+                if constexpr (POLICY::stats) {
+                    stripe().ctor_failures.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (s) destroy_slot(s);
+                cancel_reservation();
+                note_build_failed();
+                throw;
+            }
+            note_build_ok();
+            return s;
+        }
+
+        void set_breaker(const RCPoolBreaker & b) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            breaker = b;
+            breaker.jitter = std::min(std::max(b.jitter, 0.0), 1.0);
+            breaker_failures = b.failures;
+            if (!b.failures && tripped.load()) {
+                close_breaker();
+            }
+        }
+
+        void note_build_ok() {
+            if (fail_streak.load(std::memory_order_relaxed)) {
+                fail_streak.store(0, std::memory_order_relaxed);
+            }
+            if (tripped.load()) {
+                std::lock_guard<std::mutex> lk(cvlock);
+                if (tripped.load()) close_breaker();
+            }
+        }
+
+        void note_build_failed() {
+            size_t n = breaker_failures.load(std::memory_order_relaxed);
+            if (!n || fail_streak.fetch_add(1) + 1 < n) return;
+            std::lock_guard<std::mutex> lk(cvlock);
+            trip();
+        }
+
+        // under cvlock: open the breaker, or keep it open for longer after
+        // a failed probe, and have the keeper probe once the backoff ends
+        void trip() {
+            if (probe_pending || orphaned) return;
+            try {
+                start_keeper();
+            }
+            catch (...) {
+                // nobody to probe, stay closed
+                return;
+            }
+            double ms = static_cast<double>(breaker.backoff.count()) * std::pow(2.0, static_cast<double>(std::min<size_t>(trips, 30)));
+            ms = std::min(ms, static_cast<double>(breaker.max_backoff.count()));
+            static thread_local std::minstd_rand rng(static_cast<unsigned>(
+                std::chrono::steady_clock::now().time_since_epoch().count() ^ id));
+            ms *= 1.0 - breaker.jitter * std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+            trips++;
+            tripped = true;
+            probe_pending = true;
+            probe_at = std::chrono::steady_clock::now() + std::chrono::ceil<Duration>(std::chrono::duration<double, std::milli>(ms));
+            keeper_cv.notify_one();
+        }
+
+        // under cvlock
+        void close_breaker() {
+            tripped = false;
+            probe_pending = false;
+            trips = 0;
+            fail_streak = 0;
+        }
+
+        // Keeper, under cvlock: the one build allowed while the breaker is
+        // open. build_idle() closes it or trips it again; with no room to
+        // build into, look again after the shortest backoff.
+        void probe(std::unique_lock<std::mutex> & uq_cvlock) {
+            if (!tripped.load() || orphaned) return;
+            if (total() >= cap()) {
+                probe_pending = true;
+                probe_at = std::chrono::steady_clock::now() + breaker.backoff;
+                return;
+            }
+            add_total(1);
+            uq_cvlock.unlock();
+            build_idle(true);
+            uq_cvlock.lock();
+        }
+
+        // create_slot() for n slots reserved in the total, all or nothing: a
+        // failure destroys what was built and gives back every reservation
+        void create_slots(Slot ** out, size_t n) {
+            size_t made = 0;
+            if constexpr (detail::has_factory_create_n<Factory, INST_T>::value) {
+                if (n > 1 && !tripped.load()) made = create_batch(out, n);
+            }
+            try {
+                for (; made < n; made++) {
+                    out[made] = create_slot();
+                }
+            }
+            catch (...) {
+                // create_slot already gave back its own reservation
+                for (size_t i = 0; i < made; i++) {
+                    destroy_slot(out[i]);
+                }
+                if (n > 1) {
+                    cancel_reservation(n - 1);
+                }
+                throw;
+            }
+        }
+
+        // one factory create_n() call for up to n slots, returns how many
+        // it built; never throws, create_slots() retries the rest one by one
+        size_t create_batch(Slot ** out, size_t n) {
+            size_t got = 0;
+            size_t made = 0;
+            try {
+                std::vector<void *> where(n);
+                std::vector<RCPoolSlotInfo> info(n);
+                std::vector<INST_T *> inst(n);
+                for (; got < n; got++) {
+                    out[got] = new_slot();
+                    where[got] = out[got]->raw;
+                    info[got] = slot_info(out[got]);
+                }
+                Deadline t0 = build_clock();
+                made = std::min(n, factory.create_n(where.data(), info.data(), n, inst.data()));
+                auto now = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < made; i++) {
+                    Slot * s = out[i];
+                    s->inst = inst[i];
+                    if constexpr (POLICY::slot_hooks) {
+                        s->born = now;
+                        s->uses = 0;
+                    }
+                    s->broken = false;
+                    account(s);
+                }
+                if constexpr (POLICY::stats) {
+                    for (size_t i = 0; i < made; i++) {
+                        stripe().construct.add((now - t0) / made);
+                    }
+                }
+                note_build(t0, now, made);
+                if (made) note_build_ok();
+            }
+            catch (...) {
+                made = 0;
+            }
+            // hand back the slots it didn't fill
+            for (size_t i = made; i < got; i++) {
+                destroy_slot(out[i]);
+            }
+            return made;
+        }
+
+        // an empty slot for a reservation
+        Slot * new_slot() {
+            Slot * s = nullptr;
+            if constexpr (bitmap_storage) {
+                size_t i = vacant.take();
+                if (i != detail::SlotBitmap::npos) s = &arena[i];
+            }
+            else if constexpr (POLICY::lock_free || arena_storage) {
+                s = spare_stack.pop();
+            }
+            if (!s) {
+                // arena slots go back before the total drops, so a
+                // reservation always finds one
+                if constexpr (arena_storage) throw std::bad_alloc();
+                s = new Slot();
+                if constexpr (POLICY::lock_free && POLICY::hold_watch) {
+                    // lock-free mode keeps its nodes, list them for the
+                    // hold watch
+                    try {
+                        std::lock_guard<std::mutex> lk(nodes_lock);
+                        nodes.push_back(s);
+                    }
+                    catch (...) {
+                        delete s;
+                        throw;
+                    }
+                }
+            }
+            return s;
+        }
+
+        RCPoolSlotInfo slot_info(Slot * s) {
+            RCPoolSlotInfo info{shard_id, RCPoolSlotInfo::npos, built.fetch_add(1, std::memory_order_relaxed)};
+            if constexpr (arena_storage) {
+                info.slot = static_cast<size_t>(s - arena.get());
+            }
+            return info;
+        }
+
+        // destroy the resource and free its slot, call before dropping
+        // the slot from the total
+        void destroy_slot(Slot * s) {
+            if (s->inst) {
+                if constexpr (detail::has_factory_destroy<Factory, INST_T>::value) {
+                    factory.destroy(s->inst);
+                }
+                else {
+                    s->inst->~INST_T();
+                }
+                s->inst = nullptr;
+            }
+            if constexpr (POLICY::slot_hooks) {
+                if (s->bytes) {
+                    bytes -= s->bytes;
+                    s->bytes = 0;
+                }
+            }
+            if constexpr (bitmap_storage) {
+                vacant.set(static_cast<size_t>(s - arena.get()));
+            }
+            else if constexpr (POLICY::lock_free || arena_storage) {
+                // a racing pop may still read lf_next, keep the node
+                spare_stack.push(s);
+            }
+            else {
+                delete s;
+            }
+        }
+
+        // locked mode bookkeeping of checked-out slots: the used set for
+        // heap storage, an in_use flag and a count for arena storage, a
+        // bit and a count for bitmap storage, which lock-free mode keeps
+        // too (without the count)
+        void track_out(Slot * s) {
+            if constexpr (bitmap_storage) {
+                lent.set(static_cast<size_t>(s - arena.get()));
+                if constexpr (!POLICY::lock_free) used_n++;
+            }
+            else if constexpr (arena_storage) {
+                s->in_use = true;
+                used_n++;
+            }
+            else {
+                used.insert(s);
+            }
+        }
+
+        // false for a slot that isn't checked out from this pool
+        bool track_in(Slot * s) {
+            if constexpr (bitmap_storage) {
+                uintptr_t off = reinterpret_cast<uintptr_t>(s) - reinterpret_cast<uintptr_t>(arena.get());
+                if (off >= built_max * sizeof(Slot) || off % sizeof(Slot)) return false;
+                if (!lent.clear(off / sizeof(Slot))) return false;
+                if constexpr (!POLICY::lock_free) used_n--;
+                return true;
+            }
+            else if constexpr (arena_storage) {
+                uintptr_t off = reinterpret_cast<uintptr_t>(s) - reinterpret_cast<uintptr_t>(arena.get());
+                if (off >= built_max * sizeof(Slot) || off % sizeof(Slot) || !s->in_use) return false;
+                s->in_use = false;
+                used_n--;
+                return true;
+            }
+            else {
+                auto p = used.find(s);
+                if (p == used.end()) return false;
+                used.erase(p);
+                return true;
+            }
+        }
+
+        size_t used_size() {
+            if constexpr (arena_storage) {
+                return used_n;
+            }
+            else {
+                return used.size();
+            }
+        }
+
+        // lock-free mode: n slots just handed out
+        void lend(Slot ** v, size_t n) {
+            if constexpr (bitmap_storage) {
+                for (size_t i = 0; i < n; i++) {
+                    track_out(v[i]);
+                }
+            }
+            used_cnt += n;
+        }
+
+        // locked mode, under cvlock: nothing pins the pool anymore
+        bool unreferenced() {
+            return !owned && !used_size() && !pins;
+        }
+
+        // give back a slot reserved by inner_get whose construction failed
+        void cancel_reservation(size_t n = 1) {
+            std::unique_lock<std::mutex> uq_cvlock(cvlock);
+            sub_total(n);
+            serve_waiters();
+            uq_cvlock.unlock();
+            notify(n);
+        }
+
+        void inner_put(Slot * s) {
+            record_hold(s);
+            reset_on_return(s);
+            if constexpr (POLICY::thread_cache > 0) {
+                if (!s->broken && magazine_put(s)) return;
+            }
+            central_put(&s, 1);
+        }
+
+        // release_later(): buffer s, flushing when full or someone waits
+        void put_later(Slot * s) {
+            if constexpr (POLICY::thread_cache > 0 || POLICY::release_batch == 0) {
+                inner_put(s);
+            }
+            else {
+                ReleaseBuffer & rb = release_buffer();
+                try {
+                    if (rb.run.capacity() < POLICY::release_batch) {
+                        std::lock_guard<std::mutex> lk(rb.lock);
+                        rb.items.reserve(POLICY::release_batch);
+                        rb.spare.reserve(POLICY::release_batch);
+                        rb.run.reserve(POLICY::release_batch);
+                    }
+                }
+                catch (...) {
+                    inner_put(s);
+                    return;
+                }
+                record_hold(s);
+                size_t n;
+                {
+                    std::lock_guard<std::mutex> lk(rb.lock);
+                    rb.items.emplace_back(this, s);
+                    n = rb.items.size();
+                }
+                // before reading waiters, so a waiter that raised it
+                // either finds s in reclaim_released() or is seen here
+                buffered.fetch_add(1);
+                // a waiter may be after any of them, hand them all back
+                if (n >= POLICY::release_batch || waiters.load()) {
+                    rb.flush();
+                }
+            }
+        }
+
+        void flush_own_released() {
+            if constexpr (POLICY::thread_cache == 0 && POLICY::release_batch > 0) {
+                release_buffer().flush();
+            }
+        }
+
+        // Take back what other threads' release buffers hold for this
+        // pool, for a caller about to wait or fail: the reset hook runs
+        // on them here, then one good slot goes to keep when given and
+        // the rest back to the pool. Returns how many were found.
+        size_t reclaim_released(Slot ** keep = nullptr) {
+            if constexpr (POLICY::thread_cache > 0 || POLICY::release_batch == 0) {
+                return 0;
+            }
+            else {
+                if (!buffered.load()) return 0;
+                std::vector<Slot *> got;
+                try {
+                    ReleaseBuffers & all = release_buffers();
+                    std::lock_guard<std::mutex> lk(all.lock);
+                    for (ReleaseBuffer * b = all.head; b; b = b->next) {
+                        std::lock_guard<std::mutex> bl(b->lock);
+                        auto mine = [this](const std::pair<InnerRCPool *, Slot *> & e) -> bool {
+                            return e.first == this;
+                        };
+                        size_t n = static_cast<size_t>(std::count_if(b->items.begin(), b->items.end(), mine));
+                        if (!n) continue;
+                        got.reserve(got.size() + n);
+                        for (auto & e : b->items) {
+                            if (e.first == this) got.push_back(e.second);
+                        }
+                        b->items.erase(std::remove_if(b->items.begin(), b->items.end(), mine), b->items.end());
+                    }
+                }
+                catch (...) {
+                    // what was taken so far still goes back
+                }
+                if (got.empty()) return 0;
+                buffered.fetch_sub(got.size());
+                size_t found = got.size();
+                for (Slot * s : got) reset_on_return(s);
+                if (keep) {
+                    auto it = std::find_if(got.begin(), got.end(), [](Slot * s) -> bool { return !s->broken; });
+                    if (it != got.end()) {
+                        *keep = *it;
+                        got.erase(it);
+                    }
+                }
+                if (got.size()) {
+                    central_put(got.data(), got.size());
+                }
+                return found;
+            }
+        }
+
+        // validate hook with its sampling; a failed s is discarded
+        bool borrow_ok(Slot * s) {
+            if (!validate_fn) return true;
+            if constexpr (POLICY::slot_hooks) {
+                size_t n = s->uses++;
+                if (!n) return true;
+                bool check = validate_every && n % validate_every == 0;
+                if (!check && validate_idle != Duration::zero()) {
+                    check = std::chrono::steady_clock::now() - s->idle_since > validate_idle;
+                }
+                if (!check) return true;
+            }
+
+            bool ok;
+            try {
+                ok = validate_fn(*s->inst);
+            }
+            catch (...) {
+                ok = false;
+            }
+            if (ok) return true;
+            // central_put destroys it out of cvlock and frees its capacity
+            s->broken = true;
+            central_put(&s, 1);
+            return false;
+        }
+
+        // borrow_ok() for n slots, the good ones packed to the front
+        size_t borrow_ok_n(Slot ** v, size_t n) {
+            size_t good = 0;
+            for (size_t i = 0; i < n; i++) {
+                Slot * s = v[i];
+                if (borrow_ok(s)) v[good++] = s;
+            }
+            return good;
+        }
+
+        // reset hook, then the shrink one when s would otherwise be
+        // destroyed or is oversized, then a fresh footprint; marking s
+        // broken when any fails
+        void reset_on_return(Slot * s) {
+            s->shrunk = false;
+            if (!reset_fn && !shrink_fn && !footprint_fn) return;
+            bool ok = true;
+            try {
+                if (reset_fn) ok = reset_fn(*s->inst);
+                if (ok && shrink_fn) {
+                    // past idle_limit only the ttl would ever reap it
+                    bool aging = idle_ttl.load(std::memory_order_relaxed) != Duration::zero();
+                    bool big = shrink_over && footprint_fn && footprint_fn(*s->inst) > shrink_over;
+                    if (big || (aging && past_idle_limit()) || over_budget()) {
+                        ok = shrink_fn(*s->inst);
+                        s->shrunk = ok && aging;
+                    }
+                }
+                if (ok) account(s);
+            }
+            catch (...) {
+                ok = false;
+            }
+            if (!ok) s->broken = true;
+        }
+
+        // bring bytes up to date with s's footprint, may throw
+        void account(Slot * s) {
+            if constexpr (POLICY::slot_hooks) {
+                if (!footprint_fn) return;
+                size_t b = footprint_fn(*s->inst);
+                if (b >= s->bytes) {
+                    bytes += b - s->bytes;
+                }
+                else {
+                    bytes -= s->bytes - b;
+                }
+                s->bytes = b;
+            }
+        }
+
+        // take up to n idle slots in one go, marking them used
+        size_t central_take(Slot ** out, size_t n) {
+            if constexpr (POLICY::lock_free) {
+                return take_idle(out, n);
+            }
+            else {
+                std::lock_guard<std::mutex> lk(cvlock);
+                return take_idle(out, n);
+            }
+        }
+
+        // central_take body, locked mode callers hold cvlock
+        size_t take_idle(Slot ** out, size_t n) {
+            size_t got = 0;
+            if constexpr (POLICY::lock_free) {
+                while (got < n && (out[got] = pop_idle())) {
+                    got++;
+                }
+                lend(out, got);
+            }
+            else {
+                while (got < n) {
+                    Slot * s = pop_idle();
+                    if (!s) break;
+                    try {
+                        track_out(s);
+                    }
+                    catch (...) {
+                        push_idle(s);
+                        break;
+                    }
+                    out[got++] = s;
+                }
+            }
+            return got;
+        }
+
+        // one idle slot if prio may have it, nullptr instead of building
+        Slot * take_one_idle(GetPriority prio) {
+            if constexpr (POLICY::thread_cache > 0) {
+                Slot * s = magazine_get();
+                if (s) return s;
+            }
+            Slot * s = nullptr;
+            if (!idle_count() || !resource_available(prio)) return nullptr;
+            if constexpr (POLICY::lock_free) {
+                take_idle(&s, 1);
+            }
+            else {
+                std::lock_guard<std::mutex> lk(cvlock);
+                if (resource_available(prio)) take_idle(&s, 1);
+            }
+            return s;
+        }
+
+        // undo take_idle, same locking
+        void untake_idle(Slot ** v, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                if constexpr (!POLICY::lock_free || bitmap_storage) {
+                    track_in(v[i]);
+                }
+                push_idle(v[i]);
+            }
+            if constexpr (POLICY::lock_free) {
+                used_cnt -= n;
+            }
+            serve_waiters();
+        }
+
+        // fill out[0, count) or throw having kept nothing
+        void inner_get_n(Slot ** out, size_t count, Deadline deadline) {
+            if (!count) return;
+            if (count > max_limit) {
+                throw detail::ResourceTimedoutException("Batch exceeds max_limit");
+            }
+            flush_own_released();
+
+            std::unique_lock<std::mutex> uq_cvlock = lock_pool();
+            if (below_min_idle(count)) {
+                request_refill();
+            }
+            size_t got;
+            Deadline t0 = wait_clock();
+            for (;;) {
+                got = take_idle(out, count);
+                // and what stays free covers the HIGH reserve
+                if (got + room() >= count &&
+                    got + free_count(state.load()) >= count + reserved.load(std::memory_order_relaxed)) break;
+
+                // not enough, hand back what we took instead of sitting
+                // on it while we wait
+                untake_idle(out, got);
+
+                waiters++;
+                batch_waiters++;
+                bool t = true;
+                bool reclaimed = false;
+                if constexpr (POLICY::thread_cache > 0) {
+                    // magazines stop filling once waiters is raised
+                    reclaimed = reclaim_magazines(uq_cvlock);
+                }
+                else if constexpr (POLICY::release_batch > 0) {
+                    // and so do release buffers
+                    uq_cvlock.unlock();
+                    reclaimed = reclaim_released() != 0;
+                    uq_cvlock.lock();
+                }
+                if (!reclaimed) {
+                    t = wait_step(uq_cvlock, deadline);
+                }
+                waiters--;
+                batch_waiters--;
+                if (!t) {
+                    // pass on a wakeup we may have swallowed
+                    notify(1);
+                    note_wait(t0);
+                    throw detail::ResourceTimedoutException("Timedout");
+                }
+            }
+            note_wait(t0);
+
+            // reserve the rest, then construct them unlocked
+            size_t need = count - got;
+            add_total(need);
+            uq_cvlock.unlock();
+
+            try {
+                create_slots(out + got, need);
+            }
+            catch (...) {
+                if (got) {
+                    central_put(out, got);
+                }
+                throw;
+            }
+
+            // publish
+            if constexpr (POLICY::lock_free) {
+                lend(out + got, need);
+            }
+            else {
+                uq_cvlock.lock();
+                try {
+                    for (size_t i = got; i < count; i++) {
+                        track_out(out[i]);
+                    }
+                }
+                catch (...) {
+                    // drop whatever didn't make it into used
+                    size_t i = got;
+                    while (i < count && track_in(out[i])) i++;
+                    uq_cvlock.unlock();
+                    for (size_t j = got; j < count; j++) {
+                        destroy_slot(out[j]);
+                    }
+                    cancel_reservation(need);
+                    if (got) {
+                        central_put(out, got);
+                    }
+                    throw;
+                }
+            }
+        }
+
+        // return n used slots with one lock acquisition and one wakeup pass
+        void central_put(Slot ** v, size_t n) {
+            if constexpr (POLICY::lock_free) {
+                if constexpr (bitmap_storage) {
+                    // drop any that aren't checked out from this pool
+                    size_t good = 0;
+                    for (size_t i = 0; i < n; i++) {
+                        if (track_in(v[i])) v[good++] = v[i];
+                    }
+                    n = good;
+                    if (!n) return;
+                }
+                size_t outstanding = used_cnt.load() & ~owner_gone;
+                size_t destroyed = 0;
+                // keep everything for the queue while someone is waiting
+                bool queued = waiters.load() != 0;
+                for (size_t i = 0; i < n; i++) {
+                    bool excess = (outstanding - i > idle_limit && !v[i]->shrunk) || over_budget();
+                    if (orphaned || (!queued && excess) || v[i]->broken || past_lifetime(v[i])) {
+                        destroy_slot(v[i]);
+                        destroyed++;
+                    }
+                    else {
+                        push_idle(v[i]);
+                    }
+                }
+                if (destroyed) {
+                    std::unique_lock<std::mutex> uq_cvlock = lock_pool();
+                    sub_total(destroyed);
+                    serve_waiters();
+                    uq_cvlock.unlock();
+                    notify(n);
+                }
+                // waiters is only raised under cvlock, taking it here
+                // orders the pushes against a waiter's predicate check
+                else if (waiters.load()) {
+                    {
+                        std::lock_guard<std::mutex> lk(cvlock);
+                        serve_waiters();
+                    }
+                    notify(n);
+                }
+
+                // our slots pin the pool until here, don't touch it after
+                if (used_cnt.fetch_sub(n) == (owner_gone | n)) {
+                    delete this;
+                }
+                return;
+            }
+
+            Slot * doomed = nullptr;
+            size_t ndoomed = 0;
+            std::unique_lock<std::mutex> uq_cvlock = lock_pool();
+            for (size_t i = 0; i < n; i++) {
+                Slot * s = v[i];
+                if (!track_in(s)) continue;
+
+                // back to unused if < idle_limit (or shrunk) and within
+                // the budget, or while someone is queued for it
+                bool keep = (used_size() < idle_limit || s->shrunk) && (!over_budget() || waiters.load());
+                if (!orphaned && (keep || waitq_head) && !s->broken && !past_lifetime(s)) {
+                    push_idle(s);
+                }
+                else {
+                    s->next = doomed;
+                    doomed = s;
+                    ndoomed++;
+                }
+            }
+
+            serve_waiters();
+
+            bool last;
+            if (ndoomed) {
+                // destroy unlocked, the slots stay counted in the total and
+                // pin the pool until they're gone
+                pins += ndoomed;
+                uq_cvlock.unlock();
+
+                while (doomed) {
+                    Slot * s = doomed;
+                    doomed = s->next;
+                    destroy_slot(s);
+                }
+
+                uq_cvlock.lock();
+                pins -= ndoomed;
+                sub_total(ndoomed);
+                serve_waiters();
+            }
+
+            // notify before unlocking, once cvlock is released the pool
+            // may already be gone
+            notify(n);
+            last = unreferenced();
+            uq_cvlock.unlock();
+
+            if (last) {
+                delete this;
+            }
+        }
+
+        void notify(size_t n) {
+            // a batch waiter may need more than one wakeup's worth, and
+            // ignores ones it can't use, as does a NORMAL get yielding to
+            // a HIGH one
+            if (n > 1 || batch_waiters.load() || high_waiters.load()) {
+                cv.notify_all();
+            }
+            else {
+                cv.notify_one();
+            }
+        }
+
+        Magazine * local_magazine() {
+            static thread_local ThreadCache tc;
+            if (tc.last_id == id) return tc.last;
+
+            Magazine * m = nullptr;
+            for (auto & e : tc.mags) {
+                if (e.first == id) m = e.second.get();
+            }
+            if (!m) {
+                // drop entries of pools that are gone
+                tc.mags.erase(std::remove_if(tc.mags.begin(), tc.mags.end(),
+                    [](const std::pair<uint64_t, std::shared_ptr<Magazine>> & e) -> bool {
+                        return e.second->pool == nullptr;
+                    }), tc.mags.end());
+
+                auto nm = std::make_shared<Magazine>();
+                nm->pool = this;
+                {
+                    std::lock_guard<std::mutex> lk(mags_lock);
+                    mags.erase(std::remove_if(mags.begin(), mags.end(),
+                        [](const std::shared_ptr<Magazine> & e) -> bool { return e->dead; }), mags.end());
+                    mags.push_back(nm);
+                }
+                tc.mags.emplace_back(id, nm);
+                m = nm.get();
+            }
+            tc.last_id = id;
+            tc.last = m;
+            return m;
+        }
+
+        Slot * magazine_get() {
+            Magazine * m;
+            try {
+                m = local_magazine();
+            }
+            catch (...) {
+                return nullptr;
+            }
+
+            for (;;) {
+                Slot * s = nullptr;
+                {
+                    std::lock_guard<std::mutex> ml(m->lock);
+                    if (m->count) s = m->items[--m->count];
+                }
+                if (!s) break;
+                if (!past_lifetime(s)) return s;
+                // central_put destroys it
+                central_put(&s, 1);
+            }
+
+            // refill half a magazine from the central pool at once, only
+            // this thread adds to m so the room is still there after
+            Slot * batch[(POLICY::thread_cache + 1) / 2];
+            size_t n = central_take(batch, sizeof(batch) / sizeof(batch[0]));
+            if (n > 1) {
+                std::lock_guard<std::mutex> ml(m->lock);
+                for (size_t i = 1; i < n; i++) {
+                    m->items[m->count++] = batch[i];
+                }
+            }
+            return n ? batch[0] : nullptr;
+        }
+
+        bool magazine_put(Slot * s) {
+            Magazine * m;
+            try {
+                m = local_magazine();
+            }
+            catch (...) {
+                return false;
+            }
+
+            Slot * batch[POLICY::thread_cache + 1];
+            size_t n = 0;
+            {
+                std::lock_guard<std::mutex> ml(m->lock);
+                if (orphaned || past_lifetime(s)) {
+                    // retire() may already have swept m, don't strand s;
+                    // an expired s goes to central_put to be destroyed
+                    batch[n++] = s;
+                }
+                else if (!waiters.load() && m->count < m->items.size()) {
+                    if constexpr (POLICY::slot_hooks) {
+                        if (validate_idle != Duration::zero()) {
+                            s->idle_since = std::chrono::steady_clock::now();
+                        }
+                    }
+                    m->items[m->count++] = s;
+                    return true;
+                }
+                else {
+                    // full, flush the older half; with waiters, flush it all
+                    bool waiting = waiters.load() != 0;
+                    size_t flush = waiting ? m->count : (m->count + 1) / 2;
+                    for (; n < flush; n++) {
+                        batch[n] = m->items[n];
+                    }
+                    std::copy(m->items.begin() + flush, m->items.begin() + m->count, m->items.begin());
+                    m->count -= flush;
+                    if (waiting) {
+                        batch[n++] = s;
+                    }
+                    else {
+                        m->items[m->count++] = s;
+                    }
+                }
+            }
+            central_put(batch, n);
+            return true;
+        }
+
+        // move everything threads cache back to the central pool, for a
+        // batch caller about to wait; drops cvlock meanwhile
+        bool reclaim_magazines(std::unique_lock<std::mutex> & uq_cvlock) {
+            uq_cvlock.unlock();
+            std::vector<Slot *> cached;
+            {
+                std::lock_guard<std::mutex> lk(mags_lock);
+                for (auto & m : mags) {
+                    std::lock_guard<std::mutex> ml(m->lock);
+                    cached.insert(cached.end(), m->items.begin(), m->items.begin() + m->count);
+                    m->count = 0;
+                }
+            }
+            if (cached.size()) {
+                central_put(cached.data(), cached.size());
+            }
+            uq_cvlock.lock();
+            return cached.size() != 0;
+        }
+
+        // take one slot cached by any thread, for a caller about to wait
+        Slot * magazine_steal() {
+            std::lock_guard<std::mutex> lk(mags_lock);
+            for (auto & m : mags) {
+                std::lock_guard<std::mutex> ml(m->lock);
+                if (m->count) return m->items[--m->count];
+            }
+            return nullptr;
+        }
+
+        // cvlock, counting it as contended when someone already holds it
+        std::unique_lock<std::mutex> lock_pool() {
+            if constexpr (POLICY::stats) {
+                std::unique_lock<std::mutex> lk(cvlock, std::try_to_lock);
+                if (!lk.owns_lock()) {
+                    stripe().contended.fetch_add(1, std::memory_order_relaxed);
+                    lk.lock();
+                }
+                return lk;
+            }
+            else {
+                return std::unique_lock<std::mutex>(cvlock);
+            }
+        }
+
+        // stats policy: counters striped by thread so recording never
+        // shares a cache line across threads that often
+        struct StatHist {
+            std::array<std::atomic<uint64_t>, 64> buckets{};
+            std::atomic<uint64_t> count{0};
+            std::atomic<uint64_t> sum_ns{0};
+
+            void add(Duration d) {
+                uint64_t ns = d.count() > 0 ? std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() : 0;
+                size_t b = 0;
+                for (uint64_t v = ns; v > 1; v >>= 1) b++;
+                buckets[b].fetch_add(1, std::memory_order_relaxed);
+                count.fetch_add(1, std::memory_order_relaxed);
+                sum_ns.fetch_add(ns, std::memory_order_relaxed);
+            }
+
+            void read(RCPoolHistogram & h) {
+                for (size_t i = 0; i < buckets.size(); i++) {
+                    h.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+                }
+                h.count += count.load(std::memory_order_relaxed);
+                h.sum_ns += sum_ns.load(std::memory_order_relaxed);
+            }
+        };
+
+        struct alignas(ArenaStorage::cache_line) StatStripe {
+            StatHist acquire_wait;
+            StatHist construct;
+            StatHist hold;
+            std::atomic<uint64_t> gets{0};
+            std::atomic<uint64_t> timeouts{0};
+            std::atomic<uint64_t> ctor_failures{0};
+            std::atomic<uint64_t> contended{0};
+        };
+
+        static constexpr size_t stat_stripes = 16;
+        static inline std::atomic<size_t> stripe_seq{0};
+
+        StatStripe & stripe() {
+            static thread_local size_t idx = stripe_seq++ % stat_stripes;
+            return (*stat_block)[idx];
+        }
+
+        // a timestamp when stats are on, no clock read otherwise
+        Deadline stat_clock() {
+            if constexpr (POLICY::stats) {
+                return std::chrono::steady_clock::now();
+            }
+            else {
+                return Deadline();
+            }
+        }
+
+        // one get of n slots that started at t0
+        void record_get(Deadline t0, Slot ** v, size_t n, GetStatus err) {
+            if constexpr (POLICY::stats) {
+                Deadline now = std::chrono::steady_clock::now();
+                StatStripe & st = stripe();
+                st.acquire_wait.add(now - t0);
+                st.gets.fetch_add(1, std::memory_order_relaxed);
+                if (err == GetStatus::TIMEOUT) {
+                    st.timeouts.fetch_add(1, std::memory_order_relaxed);
+                }
+                for (size_t i = 0; i < n; i++) {
+                    v[i]->lent = now;
+                }
+            }
+            if constexpr (POLICY::hold_watch) {
+                if (hold_watching.load(std::memory_order_relaxed)) {
+                    for (size_t i = 0; i < n; i++) {
+                        note_lent(v[i]);
+                    }
+                }
+            }
+        }
+
+        void record_hold(Slot * s) {
+            if constexpr (POLICY::stats) {
+                stripe().hold.add(std::chrono::steady_clock::now() - s->lent);
+            }
+            if constexpr (POLICY::hold_watch) {
+                if (s->held_since.load(std::memory_order_relaxed)) {
+                    note_returned(s);
+                }
+            }
+        }
+
+        // hold watch: stamp a lease, its stack too one time in sample_every
+        void note_lent(Slot * s) {
+            int64_t t = coarse_ns.load(std::memory_order_relaxed);
+            s->reported.store(false, std::memory_order_relaxed);
+            s->held_since.store(t ? t : 1, std::memory_order_relaxed);
+#ifdef MK_RCPOOL_BACKTRACE
+            size_t every = hold_sample.load(std::memory_order_relaxed);
+            static thread_local size_t countdown = 0;
+            if (!every) return;
+            if (countdown) {
+                countdown--;
+                return;
+            }
+            countdown = every - 1;
+            Trace tr;
+            tr.n = static_cast<size_t>(std::max(0, backtrace(tr.frames.data(), static_cast<int>(tr.frames.size()))));
+            try {
+                std::lock_guard<std::mutex> lk(trace_lock);
+                traces[s] = tr;
+                s->traced.store(true, std::memory_order_relaxed);
+            }
+            catch (...) {
+                // no stack for this one
+            }
+#endif
+        }
+
+        void note_returned(Slot * s) {
+            s->held_since.store(0, std::memory_order_relaxed);
+            if (s->traced.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> lk(trace_lock);
+                traces.erase(s);
+                s->traced.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        void set_hold_watch(const RCPoolHoldWatch & w, HoldReport report) {
+            std::lock_guard<std::mutex> lk(cvlock);
+            if (w.threshold <= w.threshold.zero()) {
+                hold_watching = false;
+                return;
+            }
+            start_keeper();
+            hold = w;
+            hold_report = std::move(report);
+            hold_sample = w.sample_every;
+            coarse_ns = clock_ns(std::chrono::steady_clock::now());
+            next_hold_check = std::chrono::steady_clock::now() + hold_interval();
+            hold_watching = true;
+            keeper_cv.notify_one();
+        }
+
+        static int64_t clock_ns(Deadline t) {
+            return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count());
+        }
+
+        // a few checks per threshold, within [1ms, 1s]; also the
+        // resolution of the handout stamps
+        Duration hold_interval() {
+            return std::min<Duration>(std::max<Duration>(hold.threshold / 4, std::chrono::milliseconds(1)), std::chrono::seconds(1));
+        }
+
+        // Keeper, under cvlock: tick the coarse clock and report leases
+        // newly past the threshold, with cvlock dropped
+        void check_holds(std::unique_lock<std::mutex> & uq_cvlock, Deadline now) {
+            coarse_ns.store(clock_ns(now), std::memory_order_relaxed);
+            std::vector<HeldLease> late;
+            try {
+                late = held_leases_locked(hold.threshold, true);
+            }
+            catch (...) {
+                return;
+            }
+            if (late.empty() || !hold_report) return;
+            HoldReport report = hold_report;
+            uq_cvlock.unlock();
+            try {
+                report(late);
+            }
+            catch (...) {}
+            uq_cvlock.lock();
+        }
+
+        std::vector<HeldLease> held_leases(Duration over) {
+            if constexpr (POLICY::lock_free || arena_storage) {
+                return held_leases_locked(over, false);
+            }
+            else {
+                std::lock_guard<std::mutex> lk(cvlock);
+                return held_leases_locked(over, false);
+            }
+        }
+
+        // Leases stamped longer than over ago, longest first; with
+        // only_new, those not reported yet, marking them reported. Locked
+        // heap mode walks used and needs cvlock, the others walk slots
+        // that are never freed while the pool lives.
+        std::vector<HeldLease> held_leases_locked(Duration over, bool only_new) {
+            int64_t now = clock_ns(std::chrono::steady_clock::now());
+            int64_t limit = static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(over).count());
+            std::vector<std::pair<int64_t, Slot *>> found;
+            auto look = [&](Slot * s) {
+                int64_t t = s->held_since.load(std::memory_order_relaxed);
+                if (!t || now - t < limit) return;
+                if (only_new && s->reported.exchange(true, std::memory_order_relaxed)) return;
+                found.emplace_back(now - t, s);
+            };
+            if constexpr (arena_storage) {
+                for (size_t i = 0; i < built_max; i++) look(&arena[i]);
+            }
+            else if constexpr (POLICY::lock_free) {
+                std::lock_guard<std::mutex> lk(nodes_lock);
+                for (Slot * s : nodes) look(s);
+            }
+            else {
+                for (Slot * s : used) look(s);
+            }
+            std::sort(found.begin(), found.end(),
+                [](const std::pair<int64_t, Slot *> & a, const std::pair<int64_t, Slot *> & b) -> bool {
+                    return a.first > b.first;
+                });
+
+            std::vector<HeldLease> r;
+            for (auto & f : found) {
+                HeldLease h;
+                h.held = std::chrono::duration_cast<Duration>(std::chrono::nanoseconds(std::max<int64_t>(f.first, 0)));
+#ifdef MK_RCPOOL_BACKTRACE
+                if (f.second->traced.load(std::memory_order_relaxed)) {
+                    Trace tr;
+                    bool have = false;
+                    {
+                        std::lock_guard<std::mutex> lk(trace_lock);
+                        auto it = traces.find(f.second);
+                        if (it != traces.end()) {
+                            tr = it->second;
+                            have = true;
+                        }
+                    }
+                    if (have && tr.n) {
+                        char ** names = backtrace_symbols(tr.frames.data(), static_cast<int>(tr.n));
+                        if (names) {
+                            for (size_t i = 0; i < tr.n; i++) h.stack.emplace_back(names[i]);
+                            std::free(names);
+                        }
+                    }
+                }
+#endif
+                r.push_back(std::move(h));
+            }
+            return r;
+        }
+
+        RCPoolStats collect_stats() {
+            RCPoolStats r;
+            for (StatStripe & st : *stat_block) {
+                st.acquire_wait.read(r.acquire_wait);
+                st.construct.read(r.construct);
+                st.hold.read(r.hold);
+                r.gets += st.gets.load(std::memory_order_relaxed);
+                r.timeouts += st.timeouts.load(std::memory_order_relaxed);
+                r.ctor_failures += st.ctor_failures.load(std::memory_order_relaxed);
+                r.contended += st.contended.load(std::memory_order_relaxed);
+            }
+            return r;
+        }
+
+        // an idle resource to take or room to build one, from one load;
+        // exact under cvlock, a hint without it
+        // NORMAL gets also leave the reserve alone and yield to waiting
+        // HIGH ones
+        bool resource_available(GetPriority prio = GetPriority::NORMAL) {
+            uint64_t w = state.load();
+            if (prio == GetPriority::HIGH) {
+                return (w & idle_mask) || (w >> count_bits) < cap();
+            }
+            return free_count(w) > reserved.load(std::memory_order_relaxed) && !high_waiters.load();
+        }
+
+        // idle plus not yet built
+        size_t free_count(uint64_t w) {
+            size_t total_n = static_cast<size_t>(w >> count_bits);
+            size_t max_n = cap();
+            return static_cast<size_t>(w & idle_mask) + (total_n < max_n ? max_n - total_n : 0);
+        }
+
+        void set_reserved(size_t n) {
+            {
+                std::lock_guard<std::mutex> lk(cvlock);
+                reserved = std::min<size_t>(n, max_limit);
+                serve_waiters();
+            }
+            cv.notify_all();
+        }
+
+        // every resource the pool is accountable for: idle, checked out,
+        // cached, being built or waiting to be destroyed
+        size_t total() {
+            return static_cast<size_t>(state.load() >> count_bits);
+        }
+
+        void add_total(size_t n) {
+            uint64_t d = static_cast<uint64_t>(n) << count_bits;
+            note_peaks(state.fetch_add(d) + d);
+        }
+
+        // raise the high-water marks to state word w; a relaxed load and
+        // no store unless one is passed
+        void note_peaks(uint64_t w) {
+            size_t total_n = static_cast<size_t>(w >> count_bits);
+            size_t busy = total_n - static_cast<size_t>(w & idle_mask);
+            raise(peak_total, total_n);
+            raise(peak_in_use, busy);
+        }
+
+        static void raise(std::atomic<size_t> & peak, size_t v) {
+            size_t p = peak.load(std::memory_order_relaxed);
+            while (v > p && !peak.compare_exchange_weak(p, v, std::memory_order_relaxed)) {}
+        }
+
+        RCPoolSnapshot snapshot() {
+            RCPoolSnapshot r;
+            uint64_t w = state.load();
+            for (int tries = 0; ; tries++) {
+                r.waiters = waiters.load();
+                r.max_limit = max_limit.load();
+                r.peak_total = peak_total.load(std::memory_order_relaxed);
+                r.peak_in_use = peak_in_use.load(std::memory_order_relaxed);
+                uint64_t again = state.load();
+                // a pool this busy never holds still, settle for the last read
+                if (again == w || tries == 8) break;
+                w = again;
+            }
+            r.total = static_cast<size_t>(w >> count_bits);
+            r.idle = static_cast<size_t>(w & idle_mask);
+            r.in_use = r.total - r.idle;
+            r.peak_total = std::max(r.peak_total, r.total);
+            r.peak_in_use = std::max(r.peak_in_use, r.in_use);
+            return r;
+        }
+
+        void reset_peaks() {
+            uint64_t w = state.load();
+            peak_total = static_cast<size_t>(w >> count_bits);
+            peak_in_use = static_cast<size_t>(w >> count_bits) - static_cast<size_t>(w & idle_mask);
+        }
+
+        void sub_total(size_t n) {
+            state.fetch_sub(static_cast<uint64_t>(n) << count_bits);
+        }
+
+        // capacity left to build into, none while a shrink is draining
+        size_t room() {
+            size_t total_n = total();
+            size_t max_n = cap();
+            return total_n < max_n ? max_n - total_n : 0;
+        }
+
+        // what the total may grow to: max_limit, or nothing more while
+        // the footprint is at or over a set budget
+        size_t cap() {
+            size_t b = budget.load(std::memory_order_relaxed);
+            if (b && bytes.load(std::memory_order_relaxed) >= b) return 0;
+            return max_limit;
+        }
+
+        bool over_budget() {
+            size_t b = budget.load(std::memory_order_relaxed);
+            return b && bytes.load(std::memory_order_relaxed) > b;
+        }
+
+        // checked out or being built, a hint outside cvlock
+        bool past_idle_limit() {
+            uint64_t w = state.load();
+            return (w >> count_bits) - (w & idle_mask) > idle_limit;
+        }
+
+        // idle list / idle_stack entries; raised before a push and dropped
+        // after a pop, so it never underflows into the total
+        size_t idle_count() {
+            return static_cast<size_t>(state.load() & idle_mask);
+        }
+
+        static inline std::atomic<uint64_t> pool_seq{0};
+        // used_cnt flag set once the RCPool is gone
+        static constexpr size_t owner_gone = ~(~size_t(0) >> 1);
+
+        // total() in the high half, idle_count() in the low half
+        static constexpr unsigned count_bits = 32;
+        static constexpr uint64_t idle_mask = (uint64_t(1) << count_bits) - 1;
+
+        const uint64_t id = ++pool_seq;
+        // runtime limits, see resize(); built_max sizes the arena
+        std::atomic<size_t> idle_limit;
+        std::atomic<size_t> max_limit;
+        size_t built_max;
+        std::atomic<uint64_t> state{0};
+        // snapshot() high-water marks
+        std::atomic<size_t> peak_total{0};
+        std::atomic<size_t> peak_in_use{0};
+        std::atomic<size_t> waiters{0};
+        std::atomic<size_t> batch_waiters{0};
+        // GetPriority::HIGH gets blocked, and the capacity kept for them
+        std::atomic<size_t> high_waiters{0};
+        std::atomic<size_t> reserved{0};
+        // acquire_all() callers, see watch()
+        std::vector<RCPoolWatch *> watches;
+        // fair mode and async FIFO
+        Waiter * waitq_head = nullptr;
+        Waiter * waitq_tail = nullptr;
+        // keeper thread, async deadlines and completions to deliver
+        std::thread keeper;
+        std::condition_variable keeper_cv;
+        bool keeper_stop = false;
+        std::multimap<Deadline, AsyncOp *> timers;
+        AsyncOp * ready_head = nullptr;
+        AsyncOp * ready_tail = nullptr;
+        // kept idle by the keeper, warm_goal is a one-off warm() target
+        std::atomic<size_t> min_idle{0};
+        std::atomic<size_t> warm_goal{0};
+        std::atomic<bool> refill_pending{false};
+        // 0 disables, next_reap is the keeper's
+        std::atomic<Duration> idle_ttl{Duration::zero()};
+        std::atomic<Duration> max_lifetime{Duration::zero()};
+        Deadline next_reap{};
+        // lock-free mode: no idle slot is due for reaping before this
+        std::atomic<Deadline> idle_due{Deadline()};
+        // idle resources over the limits after a shrink, for the keeper
+        bool trim_pending = false;
+        // set_autosize() bounds and the controller's keeper-side state;
+        // slow_waits and build_ns/builds are fed by gets and creations
+        RCPoolAutoSize autosize{};
+        std::atomic<bool> autosizing{false};
+        Deadline next_autosize{};
+        // circuit breaker: failures in a row, open while tripped; the rest
+        // is under cvlock, probe_at being when the keeper next probes
+        RCPoolBreaker breaker{0};
+        std::atomic<size_t> breaker_failures{0};
+        std::atomic<size_t> fail_streak{0};
+        std::atomic<bool> tripped{false};
+        bool probe_pending = false;
+        Deadline probe_at{};
+        size_t trips = 0;
+        // hold watch, settings and keeper side under cvlock; coarse_ns is
+        // the keeper's clock that leases are stamped with
+        struct Trace {
+            std::array<void *, 32> frames;
+            size_t n = 0;
+        };
+        RCPoolHoldWatch hold{};
+        HoldReport hold_report;
+        std::atomic<bool> hold_watching{false};
+        std::atomic<size_t> hold_sample{0};
+        std::atomic<int64_t> coarse_ns{0};
+        Deadline next_hold_check{};
+        std::mutex trace_lock;
+        std::unordered_map<Slot *, Trace> traces;
+        // lock-free heap mode, every node it allocated
+        std::mutex nodes_lock;
+        std::vector<Slot *> nodes;
+        double load_avg = 0;
+        double build_avg_ns = 0;
+        std::atomic<size_t> slow_waits{0};
+        std::atomic<uint64_t> build_ns{0};
+        std::atomic<uint64_t> builds{0};
+        std::atomic<bool> orphaned{false};
+        bool owned = true;
+        // slots being destroyed unlocked, plus live AsyncOps
+        size_t pins = 0;
+        std::mutex cvlock;
+        std::condition_variable cv;
+        // locked mode
+        std::unordered_set<Slot *> used;
+        size_t used_n = 0;
+        Slot * unused = nullptr;
+        Slot * unused_tail = nullptr;
+        // popped past max_lifetime, waiting for the keeper
+        Slot * expired = nullptr;
+        detail::TaggedStack<Slot> expired_stack;
+        // lock-free mode
+        std::atomic<size_t> used_cnt{0};
+        detail::TaggedStack<Slot> idle_stack;
+        detail::TaggedStack<Slot> spare_stack;
+        // thread caches
+        std::mutex mags_lock;
+        std::vector<std::shared_ptr<Magazine>> mags;
+        // leases sitting in threads' release buffers
+        std::atomic<size_t> buffered{0};
+        // arena storage, free slots wait in spare_stack, or in vacant
+        // with bitmap storage, which marks checked-out ones in lent
+        std::unique_ptr<Slot[]> arena;
+        detail::SlotBitmap vacant;
+        detail::SlotBitmap lent;
+        Factory factory;
+        // RCPoolSlotInfo for the factory
+        size_t shard_id = 0;
+        std::atomic<uint64_t> built{0};
+        // stats policy only
+        std::unique_ptr<std::array<StatStripe, stat_stripes>> stat_block;
+        // borrow/return hooks
+        std::function<bool(INST_T &)> validate_fn;
+        std::function<bool(INST_T &)> reset_fn;
+        std::function<bool(INST_T &)> shrink_fn;
+        std::function<size_t(const INST_T &)> footprint_fn;
+        size_t shrink_over = 0;
+        // summed footprint_fn() readings of live resources, and the cap on it
+        std::atomic<size_t> bytes{0};
+        std::atomic<size_t> budget{0};
+        size_t validate_every = 1;
+        Duration validate_idle{};
+    };
+
+    // One async_get() request, shared by the caller's handle, the pool
+    // while it is queued or waiting for the keeper, and the executor task
+    // completing it. It pins the pool until the last of those lets go.
+    struct AsyncOp : std::enable_shared_from_this<AsyncOp> {
+        AsyncOp(InnerRCPool * p, Executor e, GetCallback c, Deadline d) :
+            pool(p), ex(std::move(e)), cb(std::move(c)), deadline(d), started(p->stat_clock())
+        {}
+
+        // disallow copy
+        AsyncOp(const AsyncOp & rhs) = delete;
+        AsyncOp & operator=(const AsyncOp & rhs) = delete;
+
+        ~AsyncOp() {
+            // never delivered, e.g. the executor dropped the task
+            if (slot) {
+                pool->central_put(&slot, 1);
+            }
+            if (create) {
+                pool->cancel_reservation();
+            }
+            if (pinned) {
+                pool->unpin();
+            }
+        }
+
+        bool cancel() {
+            std::lock_guard<std::mutex> lk(pool->cvlock);
+            if (done) return false;
+            if (queued) {
+                pool->async_done(this, GetStatus::CANCELED);
+            }
+            else {
+                // not started, async_start() completes it
+                status = GetStatus::CANCELED;
+                done = true;
+            }
+            return true;
+        }
+
+        // the executor task: build the resource if granted capacity, then
+        // hand the lease to cb
+        void run() {
+            if (ran) return;
+            ran = true;
+            if (create) {
+                std::unique_lock<std::mutex> uq_cvlock(pool->cvlock);
+                create = false;
+                try {
+                    slot = pool->create_reserved(uq_cvlock);
+                }
+                catch (const detail::GenericResourceException & e) {
+                    status = GetStatus::CTORF;
+                }
+                catch (const detail::ResourceUnavailableException & e) {
+                    status = GetStatus::CIRCUIT_OPEN;
+                }
+                catch (...) {
+                    status = GetStatus::UNKNOWN;
+                }
+            }
+            while (slot && status == GetStatus::SUCCESS && !pool->borrow_ok(slot)) {
+                // failed validation and was discarded, take a free one or
+                // queue up again
+                slot = nullptr;
+                try {
+                    slot = pool->inner_get(Deadline::min());
+                }
+                catch (const detail::ResourceTimedoutException & e) {
+                    requeue();
+                    return;
+                }
+                catch (const detail::GenericResourceException & e) {
+                    status = GetStatus::CTORF;
+                }
+                catch (const detail::ResourceUnavailableException & e) {
+                    status = GetStatus::CIRCUIT_OPEN;
+                }
+                catch (...) {
+                    status = GetStatus::UNKNOWN;
+                }
+            }
+            if (slot && status == GetStatus::SUCCESS) {
+                Slot * s = slot;
+                slot = nullptr;
+                pool->record_get(started, &s, 1, GetStatus::SUCCESS);
+                cb(GetWrapper(pool, s, GetStatus::SUCCESS));
+            }
+            else {
+                // a slot picked up after cancel() goes back on destruction
+                GetStatus err = status == GetStatus::SUCCESS ? GetStatus::UNKNOWN : status;
+                pool->record_get(started, nullptr, 0, err);
+                cb(GetWrapper(nullptr, nullptr, err));
+            }
+        }
+
+        // back to a fresh, unstarted request with the same deadline
+        void requeue() {
+            {
+                std::lock_guard<std::mutex> lk(pool->cvlock);
+                node.next = node.prev = nullptr;
+                node.slot = nullptr;
+                node.granted = false;
+                ran = false;
+                done = false;
+            }
+            pool->async_start(this->shared_from_this());
+        }
+
+        InnerRCPool * pool;
+        Executor ex;
+        GetCallback cb;
+        Deadline deadline;
+        Deadline started;
+        typename InnerRCPool::Waiter node;
+        // the pool's reference while queued or ready
+        std::shared_ptr<AsyncOp> self;
+        AsyncOp * ready_next = nullptr;
+        typename std::multimap<Deadline, AsyncOp *>::iterator timer;
+        // all under cvlock once started
+        bool timed = false;
+        bool queued = false;
+        bool done = false;
+        bool pinned = false;
+        bool create = false;
+        bool ran = false;
+        Slot * slot = nullptr;
+        GetStatus status = GetStatus::SUCCESS;
+    };
+
+    InnerRCPool * inner_pool_;
+};
+
+// RCPool<T, SingleThreaded> and RCPool<T, Fixed<N>>: a pool for one
+// thread with no mutex, condition variable or hash set. Slots sit in an
+// array, inline in the pool with N > 0, and two bitmasks say which are
+// idle and which are lent out, so get() takes the lowest idle bit and
+// put() moves it back; neither allocates. With nothing to wait for on a
+// single thread, a get finding the pool exhausted fails with TIMEOUT at
+// once. Leases must go back, on the pool's thread, before the pool goes.
+template <class INST_T, size_t N>
+class SingleThreadedRCPool
+{
+    struct Slot {
+        alignas(INST_T) unsigned char raw[sizeof(INST_T)];
+    };
+
+    static constexpr bool inline_slots = N > 0;
+    static constexpr size_t word_bits = 64;
+    static constexpr size_t npos = ~size_t(0);
+
+public:
+    using GetStatus = typename RCPool<INST_T>::GetStatus;
+
+    // Move-only handle to a checked-out resource, see RCPool::GetWrapper.
+    class GetWrapper {
+        public:
+            GetWrapper(SingleThreadedRCPool * pool, size_t idx, GetStatus err) :
+                pool_(pool), idx_(idx), err_(err)
+            {}
+
+            // disallow copy
+            GetWrapper(const GetWrapper & rhs) = delete;
+            GetWrapper & operator=(const GetWrapper & rhs) = delete;
+
+            // allow move
+            GetWrapper(GetWrapper && rhs)
+                : pool_(rhs.pool_), idx_(rhs.idx_), err_(rhs.err_)
+            {
+                rhs.idx_ = npos;
+            }
+
+            GetWrapper & operator=(GetWrapper && rhs) {
+                if (idx_ != npos) {
+                    pool_->put(idx_);
+                }
+                pool_ = rhs.pool_;
+                idx_ = rhs.idx_;
+                err_ = rhs.err_;
+                rhs.idx_ = npos;
+                return *this;
+            }
+
+            ~GetWrapper() {
+                if (idx_ != npos) {
+                    pool_->put(idx_);
+                }
+            }
+
+            INST_T * operator->() {
+                return get();
+            }
+
+            INST_T * get() {
+                return idx_ != npos ? pool_->inst(idx_) : nullptr;
+            }
+
+            operator bool() {
+                return idx_ != npos;
+            }
+
+            GetStatus err() {
+                return err_;
+            }
+
+            const char* explain_error() {
+                return explain(err_);
+            }
+
+        private:
+            SingleThreadedRCPool * pool_;
+            size_t idx_;
+            GetStatus err_;
+    };
+
+    using Lease = GetWrapper;
+
+    // max_limit is capped at N with inline slots
+    template <class... Args>
+    SingleThreadedRCPool(size_t idle_limit_, size_t max_limit_, Args&&... _args) :
+        factory(std::forward<Args>(_args)...)
+    {
+        max_limit_ = std::max(idle_limit_, max_limit_);
+        if constexpr (inline_slots) {
+            max_limit_ = std::min(max_limit_, N);
+        }
+        else {
+            slots.reset(new Slot[max_limit_]);
+            idle.assign((max_limit_ + word_bits - 1) / word_bits, 0);
+            lent.assign(idle.size(), 0);
+        }
+        max_n = max_limit_;
+        idle_n = std::min(idle_limit_, max_limit_);
+    }
+
+    // disallow copy
+    SingleThreadedRCPool(const SingleThreadedRCPool & rhs) = delete;
+    SingleThreadedRCPool & operator=(const SingleThreadedRCPool & rhs) = delete;
+
+    // disallow move
+    SingleThreadedRCPool(SingleThreadedRCPool && rhs) = delete;
+    SingleThreadedRCPool & operator=(SingleThreadedRCPool && rhs) = delete;
+
+    ~SingleThreadedRCPool() {
+        for (size_t w = 0; w < idle.size(); w++) {
+            for (uint64_t m = idle[w] | lent[w]; m; m &= m - 1) {
+                inst(w * word_bits + detail::lowest_bit(m))->~INST_T();
+            }
+        }
+    }
+
+    // never waits, the timeouts are there to match RCPool
+    GetWrapper get(uint32_t timeout_s = 0) {
+        (void)timeout_s;
+        return try_get();
+    }
+
+    template <class Rep, class Period>
+    GetWrapper get(std::chrono::duration<Rep, Period> timeout) {
+        (void)timeout;
+        return try_get();
+    }
+
+    GetWrapper get(std::chrono::steady_clock::time_point deadline) {
+        (void)deadline;
+        return try_get();
+    }
+
+    // an idle resource, else a new one while under max_limit, else TIMEOUT
+    GetWrapper try_get() {
+        for (size_t w = 0; w < idle.size(); w++) {
+            if (uint64_t m = idle[w]) {
+                uint64_t bit = m & (~m + 1);
+                idle[w] = m ^ bit;
+                lent[w] |= bit;
+                idle_cnt--;
+                lent_cnt++;
+                return { this, w * word_bits + detail::lowest_bit(m), GetStatus::SUCCESS };
+            }
+        }
+        if (idle_cnt + lent_cnt >= max_n) {
+            return { nullptr, npos, GetStatus::TIMEOUT };
+        }
+
+        // the lowest free bit is below max_limit while there is room
+        size_t i = npos;
+        for (size_t w = 0; i == npos; w++) {
+            if (uint64_t m = ~(idle[w] | lent[w])) i = w * word_bits + detail::lowest_bit(m);
+        }
+        try {
+            factory(slots[i].raw);
+        }
+        catch (const std::exception & e) {
+            return { nullptr, npos, GetStatus::CTORF };
+        }
+        catch (...) {
+            return { nullptr, npos, GetStatus::UNKNOWN };
+        }
+        lent[i / word_bits] |= uint64_t(1) << (i % word_bits);
+        lent_cnt++;
+        return { this, i, GetStatus::SUCCESS };
+    }
+
+    size_t size() {
+        return idle_cnt + lent_cnt;
+    }
+
+    size_t idle_limit() {
+        return idle_n;
+    }
+
+    size_t max_limit() {
+        return max_n;
+    }
+
+    size_t in_use() {
+        return lent_cnt;
+    }
 
+    static const char* explain(GetStatus err) {
+        return RCPool<INST_T>::explain(err);
+    }
 
-namespace mklib {
+private:
+    INST_T * inst(size_t i) {
+        return std::launder(reinterpret_cast<INST_T *>(slots[i].raw));
+    }
 
-namespace {
-    class GenericResourceException : public std::exception {
-        public:
-            GenericResourceException(const std::string & m) : msg_(m) {}
-            const char * what() const noexcept {return msg_.c_str();}
-        private:
-            std::string msg_;
-    };
+    // kept idle while fewer than idle_limit stay lent out, as RCPool does
+    void put(size_t i) {
+        size_t w = i / word_bits;
+        uint64_t bit = uint64_t(1) << (i % word_bits);
+        // not lent out from this pool, e.g. put twice
+        if (i >= max_n || !(lent[w] & bit)) return;
+        lent[w] &= ~bit;
+        lent_cnt--;
+        if (lent_cnt < idle_n) {
+            idle[w] |= bit;
+            idle_cnt++;
+        }
+        else {
+            inst(i)->~INST_T();
+        }
+    }
 
-    class ResourceTimedoutException : public std::exception {
-        public:
-            ResourceTimedoutException(const std::string & m) : msg_(m) {}
-            const char * what() const noexcept {return msg_.c_str();}
-        private:
-            std::string msg_;
-    };
-}
+    static constexpr size_t words = (N + word_bits - 1) / word_bits;
+    using Slots = typename std::conditional<inline_slots, std::array<Slot, N>, std::unique_ptr<Slot[]>>::type;
+    using Bits = typename std::conditional<inline_slots, std::array<uint64_t, words>, std::vector<uint64_t>>::type;
+
+    detail::ArgsCreator<INST_T> factory;
+    Slots slots{};
+    // one bit per slot: built and idle, built and lent out
+    Bits idle{};
+    Bits lent{};
+    size_t idle_cnt = 0;
+    size_t lent_cnt = 0;
+    size_t idle_n;
+    size_t max_n;
+};
 
 template <class INST_T>
-class RCPool
+class RCPool<INST_T, SingleThreaded> : public SingleThreadedRCPool<INST_T, 0>
 {
 public:
-    enum class GetStatus {
-        SUCCESS,
-        CTORF,
-        TIMEOUT,
-        UNKNOWN
+    using SingleThreadedRCPool<INST_T, 0>::SingleThreadedRCPool;
+};
+
+template <class INST_T, size_t N>
+class RCPool<INST_T, Fixed<N>> : public SingleThreadedRCPool<INST_T, N>
+{
+public:
+    using SingleThreadedRCPool<INST_T, N>::SingleThreadedRCPool;
+};
+
+// N independent RCPools, each with its own cvlock and an even share of
+// idle_limit and max_limit. A get() tries the caller's home shard, then
+// steals from the others before it waits, so the limits hold overall.
+// Leases are plain RCPool GetWrappers and go back to the shard they
+// came from.
+template <class INST_T, class POLICY = RCPoolPolicy>
+class ShardedRCPool
+{
+    using Shard = RCPool<INST_T, POLICY>;
+
+public:
+    using GetWrapper = typename Shard::GetWrapper;
+    using GetStatus = typename Shard::GetStatus;
+    using GetPriority = typename Shard::GetPriority;
+
+    struct Occupancy {
+        size_t size;
+        size_t in_use;
+        size_t max_limit;
     };
 
+    // shards of 0 uses one per hardware thread; never more shards than
+    // max_limit, so every shard can hold at least one resource
+    template <class... Args>
+    ShardedRCPool(size_t shards, size_t idle_limit_, size_t max_limit_, Args&&... _args) {
+        max_limit_ = std::max(idle_limit_, max_limit_);
+        if constexpr (POLICY::shard_by_node) {
+            if (!shards) shards = detail::NumaTopology::get().nodes();
+        }
+        if (!shards) shards = std::max(1u, std::thread::hardware_concurrency());
+        shards = std::max<size_t>(1, std::min(shards, max_limit_));
+        for (size_t i = 0; i < shards; i++) {
+            size_t max_i = max_limit_ / shards + (i < max_limit_ % shards);
+            size_t idle_i = idle_limit_ / shards + (i < idle_limit_ % shards);
+            shards_.emplace_back(new Shard(idle_i, max_i, _args...));
+            shards_.back()->set_shard(i);
+        }
+    }
+
+    // disallow copy
+    ShardedRCPool(const ShardedRCPool & rhs) = delete;
+    ShardedRCPool & operator=(const ShardedRCPool & rhs) = delete;
+
+    // timeout_s of 0 waits forever
+    GetWrapper get(uint32_t timeout_s = 0, GetPriority prio = GetPriority::NORMAL) {
+        return get(Shard::deadline_after(timeout_s), prio);
+    }
+
+    template <class Rep, class Period>
+    GetWrapper get(std::chrono::duration<Rep, Period> timeout, GetPriority prio = GetPriority::NORMAL) {
+        return get(Shard::deadline_in(timeout), prio);
+    }
+
+    // Waits on the home shard and one steal target, like acquire_all():
+    // a release or a limit change in either wakes the caller to look
+    // again. Only those two count it as a waiter, so a release wakes
+    // the waiters of its own shard and its neighbour rather than all of
+    // them, and the other shards keep their fast paths. With more than
+    // two shards it looks over all of them every rescan_interval,
+    // watching the next one along each time, so a release on an
+    // unwatched shard still reaches it.
+    GetWrapper get(std::chrono::steady_clock::time_point deadline, GetPriority prio = GetPriority::NORMAL) {
+        size_t home = home_shard();
+        bool remote_build = !POLICY::shard_by_node;
+        GetStatus err = GetStatus::TIMEOUT;
+        GetWrapper g = steal(home, err, prio, remote_build);
+        if (g || err != GetStatus::TIMEOUT) return g;
+        if (std::chrono::steady_clock::now() >= deadline) return g;
+
+        size_t k = shards_.size();
+        size_t other = (home + 1) % k;
+        RCPoolWatch w;
+        try {
+            // look again once attached, a release may have slipped by
+            shards_[home]->watch(&w);
+            if (k > 1) shards_[other]->watch(&w);
+            for (;;) {
+                uint64_t seen = w.generation();
+                err = GetStatus::TIMEOUT;
+                g = steal(home, err, prio, remote_build);
+                if (g || err != GetStatus::TIMEOUT) break;
+                // shard_by_node: give the home shard a moment to free one
+                // before any shard with room may build
+                auto until = deadline;
+                if (!remote_build) {
+                    until = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(1));
+                }
+                else if (k > 2) {
+                    until = std::min(deadline, std::chrono::steady_clock::now() + rescan_interval);
+                }
+                if (w.wait(seen, until)) continue;
+                if (until == deadline) break;
+                if (remote_build && k > 2) {
+                    shards_[other]->unwatch(&w);
+                    other = (other + 1) % k;
+                    if (other == home) other = (other + 1) % k;
+                    shards_[other]->watch(&w);
+                }
+                remote_build = true;
+            }
+        }
+        catch (...) {
+            g = { nullptr, nullptr, GetStatus::UNKNOWN };
+        }
+        shards_[home]->unwatch(&w);
+        if (k > 1) shards_[other]->unwatch(&w);
+        return g;
+    }
+
+    // one pass over all shards, never waits
+    GetWrapper try_get(GetPriority prio = GetPriority::NORMAL) {
+        GetStatus err = GetStatus::TIMEOUT;
+        GetWrapper g = steal(home_shard(), err, prio, true);
+        if (g) return g;
+        return { nullptr, nullptr, err };
+    }
+
+    // see RCPool::flush_released(), covers every shard
+    static void flush_released() {
+        Shard::flush_released();
+    }
+
+    // leases served by a shard other than the caller's home one, i.e.
+    // cross-node borrows with shard_by_node
+    uint64_t remote_borrows() {
+        return remote_.load(std::memory_order_relaxed);
+    }
+
+    // split like the constructor, every shard keeps room for one
+    void resize(size_t idle_limit_, size_t max_limit_) {
+        size_t k = shards_.size();
+        max_limit_ = std::max(idle_limit_, max_limit_);
+        for (size_t i = 0; i < k; i++) {
+            size_t max_i = max_limit_ / k + (i < max_limit_ % k);
+            size_t idle_i = idle_limit_ / k + (i < idle_limit_ % k);
+            shards_[i]->resize(idle_i, std::max<size_t>(max_i, 1));
+        }
+    }
+
+    // each shard runs its own controller on its share of the bounds
+    void set_autosize(const RCPoolAutoSize & a) {
+        size_t k = shards_.size();
+        for (size_t i = 0; i < k; i++) {
+            RCPoolAutoSize b = a;
+            b.min_limit = std::max<size_t>(1, a.min_limit / k + (i < a.min_limit % k));
+            if (a.max_limit) {
+                b.max_limit = std::max<size_t>(1, a.max_limit / k + (i < a.max_limit % k));
+            }
+            shards_[i]->set_autosize(b);
+        }
+    }
+
+    // split like max_limit, see RCPool::set_reserved()
+    void set_reserved(size_t n) {
+        size_t k = shards_.size();
+        for (size_t i = 0; i < k; i++) {
+            shards_[i]->set_reserved(n / k + (i < n % k));
+        }
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (auto & s : shards_) n += s->size();
+        return n;
+    }
+
+    size_t shard_count() {
+        return shards_.size();
+    }
+
+    std::vector<Occupancy> occupancy() {
+        std::vector<Occupancy> v;
+        for (size_t i = 0; i < shards_.size(); i++) {
+            v.push_back({ shards_[i]->size(), shards_[i]->in_use(), shards_[i]->max_limit() });
+        }
+        return v;
+    }
+
+    // merged over all shards, each read on its own, see RCPool::snapshot()
+    RCPoolSnapshot snapshot() {
+        RCPoolSnapshot r;
+        for (auto & s : shards_) r.merge(s->snapshot());
+        return r;
+    }
+
+    void reset_peaks() {
+        for (auto & s : shards_) s->reset_peaks();
+    }
+
+    // merged over all shards, RCPoolPolicy::stats only
+    RCPoolStats stats() {
+        RCPoolStats r;
+        for (auto & s : shards_) r.merge(s->stats());
+        return r;
+    }
+
+    static const char* explain(GetStatus err) {
+        return Shard::explain(err);
+    }
+
+private:
+    friend class RCPoolWatch;
+
+    // a release in any shard may satisfy an acquire_all() or a get()
+    void watch(RCPoolWatch * w) {
+        for (auto & s : shards_) {
+            s->watch(w);
+        }
+    }
+
+    void unwatch(RCPoolWatch * w) {
+        for (auto & s : shards_) {
+            s->unwatch(w);
+        }
+    }
+
+    // try_get() home first, then its neighbours; err keeps the first
+    // failure that wasn't a TIMEOUT. Without remote_build the neighbours
+    // only lend what they have idle.
+    GetWrapper steal(size_t home, GetStatus & err, GetPriority prio, bool remote_build) {
+        size_t k = shards_.size();
+        for (size_t i = 0; i < k; i++) {
+            Shard & s = *shards_[(home + i) % k];
+            GetWrapper g = i == 0 || remote_build ? s.try_get(prio) : s.try_get_idle(prio);
+            if (g) {
+                if (i) remote_.fetch_add(1, std::memory_order_relaxed);
+                return g;
+            }
+            if (err == GetStatus::TIMEOUT) err = g.err();
+        }
+        return { nullptr, nullptr, err };
+    }
+
+    size_t home_shard() {
+        if constexpr (POLICY::shard_by_node) {
+#if defined(__linux__)
+            int cpu = sched_getcpu();
+            if (cpu >= 0) return topo_->node_of(cpu) % shards_.size();
+#endif
+        }
+        else if constexpr (POLICY::shard_by_cpu) {
+#if defined(__linux__)
+            int cpu = sched_getcpu();
+            if (cpu >= 0) return static_cast<size_t>(cpu) % shards_.size();
+#endif
+        }
+        static thread_local size_t h = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return h % shards_.size();
+    }
+
+    // how often a blocked get() looks beyond the two shards it watches
+    static constexpr std::chrono::milliseconds rescan_interval{10};
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // shard_by_node only
+    const detail::NumaTopology * topo_ = POLICY::shard_by_node ? &detail::NumaTopology::get() : nullptr;
+    std::atomic<uint64_t> remote_{0};
+};
+// Leases for many keys (backend hosts, tenants) under one max_limit.
+// Each key keeps its own idle list, most recently used first and at
+// most idle_per_key long. A get for a key with nothing idle builds a
+// resource, unlocked; when the pool is full it first evicts the least
+// recently idled resource of any key. Keys hash onto stripes with their
+// own locks, so gets for different keys rarely contend. Resources are
+// built as INST_T(key, _args...).
+template <class KEY, class INST_T, class HASH>
+class KeyedRCPool
+{
+    using Plain = RCPool<INST_T>;
+    using Deadline = std::chrono::steady_clock::time_point;
+    class Inner;
+    struct Entry;
+
+public:
+    using GetStatus = typename Plain::GetStatus;
+
+    // Move-only lease, see RCPool::GetWrapper. The pool's bookkeeping
+    // stays alive until the last one is released, even past
+    // ~KeyedRCPool.
     class GetWrapper {
         public:
-            GetWrapper(
-                std::shared_ptr<typename RCPool<INST_T>::InnerRCPool> pool, std::shared_ptr<INST_T> ptr, GetStatus err) :
-                rcpool_(pool), ptr_(ptr), err_(err)
+            GetWrapper(Inner * pool, Entry * e, GetStatus err) :
+                pool_(pool), e_(e), err_(err)
             {}
 
             // disallow copy
@@ -56,45 +4988,43 @@ public:
 
             // allow move
             GetWrapper(GetWrapper && rhs)
-                : rcpool_(rhs.rcpool_), ptr_(rhs.ptr_)
+                : pool_(rhs.pool_), e_(rhs.e_), err_(rhs.err_)
             {
-                // this obj is responsible for release.
-                rhs.ptr_ = nullptr;
+                rhs.e_ = nullptr;
             }
 
             GetWrapper & operator=(GetWrapper && rhs) {
-                // release mine
-                if (ptr_) {
-                    rcpool_.inner_put(ptr_);
-                    ptr_ = nullptr;
+                if (e_) {
+                    pool_->put(e_);
                 }
-
-                // inherit other
-                ptr_ = rhs.ptr_;
-
-                // rhs doesn't need release
-                rhs.ptr_ = nullptr;
-
+                pool_ = rhs.pool_;
+                e_ = rhs.e_;
+                err_ = rhs.err_;
+                rhs.e_ = nullptr;
                 return *this;
             }
 
             ~GetWrapper() {
-                // need release to pool
-                if (ptr_) {
-                    rcpool_->inner_put(ptr_);
+                if (e_) {
+                    pool_->put(e_);
                 }
             }
 
             INST_T * operator->() {
-                return ptr_.get();
+                return get();
             }
 
             INST_T * get() {
-                return ptr_.get();
+                return e_ ? e_->inst : nullptr;
+            }
+
+            // the key it was borrowed for, valid while held
+            const KEY & key() {
+                return *e_->ks->key;
             }
 
             operator bool() {
-                return ptr_;
+                return e_ != nullptr;
             }
 
             GetStatus err() {
@@ -102,160 +5032,531 @@ public:
             }
 
             const char* explain_error() {
-                switch (err_) {
-                    case GetStatus::SUCCESS: return "Success";
-                    break;
-                    case GetStatus::CTORF: return "Resource construct failed";
-                    break;
-                    case GetStatus::TIMEOUT: return "Wait resource timeout";
-                    break;
-                    case GetStatus::UNKOWN: return "Unknow fialure";
-                    break;
-                }
+                return explain(err_);
             }
 
         private:
-            std::shared_ptr<typename RCPool<INST_T>::InnerRCPool> rcpool_;
-            std::shared_ptr<INST_T> ptr_;
+            Inner * pool_;
+            Entry * e_;
             GetStatus err_;
     };
 
     template <class... Args>
-    RCPool(size_t idle_limit_, size_t max_limit_, Args&&... _args) {
-        inner_pool_ = std::make_shared<InnerRCPool> (idle_limit_, max_limit_, std::forward<Args>(_args)...);
+    KeyedRCPool(size_t idle_per_key, size_t max_limit, Args&&... _args) {
+        inner_ = new Inner(idle_per_key, max_limit, std::forward<Args>(_args)...);
     }
 
     // disallow copy
-    RCPool(const RCPool & rhs) = delete;
-    RCPool & operator=(const RCPool & rhs) = delete;
+    KeyedRCPool(const KeyedRCPool & rhs) = delete;
+    KeyedRCPool & operator=(const KeyedRCPool & rhs) = delete;
 
     // disallow copy
-    RCPool(RCPool && rhs) = delete;
-    RCPool & operator=(RCPool && rhs) = delete;
+    KeyedRCPool(KeyedRCPool && rhs) = delete;
+    KeyedRCPool & operator=(KeyedRCPool && rhs) = delete;
 
-    virtual ~RCPool() {}
+    ~KeyedRCPool() {
+        inner_->retire();
+    }
 
-    GetWrapper get(uint32_t timeout_s = 0) {
+    // timeout_s of 0 waits forever
+    GetWrapper get(const KEY & key, uint32_t timeout_s = 0) {
+        return get(key, Plain::deadline_after(timeout_s));
+    }
+
+    template <class Rep, class Period>
+    GetWrapper get(const KEY & key, std::chrono::duration<Rep, Period> timeout) {
+        return get(key, Plain::deadline_in(timeout));
+    }
+
+    GetWrapper get(const KEY & key, std::chrono::steady_clock::time_point deadline) {
         try {
-            return { inner_pool_, inner_pool_->inner_get(timeout_s), GetStatus::SUCCESS};
+            return { inner_, inner_->acquire(key, deadline), GetStatus::SUCCESS };
         }
-        catch (const ResourceTimedoutException &e) {
+        catch (const detail::ResourceTimedoutException &e) {
             return { nullptr, nullptr, GetStatus::TIMEOUT };
         }
-        catch (const GenericResourceException &e) {
-            return { nullptr, nullptr, GetStatus::CTORF};
+        catch (const detail::GenericResourceException &e) {
+            return { nullptr, nullptr, GetStatus::CTORF };
         }
         catch (...) {
             return { nullptr, nullptr, GetStatus::UNKNOWN };
         }
     }
 
+    GetWrapper try_get(const KEY & key) {
+        return get(key, std::chrono::steady_clock::time_point::min());
+    }
+
+    // Destroy up to n idle resources, least recently used first across
+    // all keys, e.g. on an outside memory pressure signal. Returns how
+    // many went.
+    size_t evict_idle(size_t n) {
+        return inner_->evict_idle(n);
+    }
+
     size_t size() {
-        return  inner_pool_->cur_sz;
+        return inner_->total.load();
+    }
+
+    size_t idle() {
+        return inner_->idle_total.load();
+    }
+
+    // keys with idle or checked-out resources
+    size_t key_count() {
+        return inner_->key_count();
+    }
+
+    static const char* explain(GetStatus err) {
+        return Plain::explain(err);
     }
 
 private:
-    class InnerRCPool {
+    struct KeyState;
+    struct Stripe;
+
+    struct Entry {
+        alignas(INST_T) unsigned char raw[sizeof(INST_T)];
+        INST_T * inst = nullptr;
+        KeyState * ks = nullptr;
+        // the key's idle list and the stripe's LRU list
+        Entry * key_prev = nullptr;
+        Entry * key_next = nullptr;
+        Entry * lru_prev = nullptr;
+        Entry * lru_next = nullptr;
+        Deadline idle_since{};
+    };
+
+    struct KeyState {
+        // the map node's key
+        const KEY * key = nullptr;
+        Stripe * stripe = nullptr;
+        Entry * idle = nullptr;
+        size_t idle_n = 0;
+        // checked out or being built
+        size_t out = 0;
+    };
+
+    struct alignas(64) Stripe {
+        std::mutex lock;
+        std::unordered_map<KEY, std::unique_ptr<KeyState>, HASH> keys;
+        // idle entries of its keys, most recently idled first
+        Entry * lru_head = nullptr;
+        Entry * lru_tail = nullptr;
+    };
+
+    class Inner {
         public:
         template <class... Args>
-        InnerRCPool(size_t idle_limit_, size_t max_limit_, Args&&... _args) {
-            cur_sz = 0;
-            idle_limit = idle_limit_;
-            max_limit = std::max(idle_limit_, max_limit_);
-            factory = [_args...]() -> std::shared_ptr<INST_T> {
-                return std::make_shared<INST_T>(_args...);
-            };
-        }
+        Inner(size_t idle_per_key_, size_t max_limit_, Args&&... _args) :
+            idle_per_key(idle_per_key_), max_limit(max_limit_), factory(std::forward<Args>(_args)...)
+        {}
 
         // disallow copy
-        InnerRCPool(const InnerRCPool & rhs) = delete;
-        InnerRCPool & operator=(const InnerRCPool & rhs) = delete;
+        Inner(const Inner & rhs) = delete;
+        Inner & operator=(const Inner & rhs) = delete;
 
-        // disallow copy
-        InnerRCPool(InnerRCPool && rhs) = delete;
-        InnerRCPool & operator=(InnerRCPool && rhs) = delete;
+        // whatever is still idle, nothing is checked out by now
+        ~Inner() {
+            for (Stripe & st : stripes) {
+                while (Entry * e = st.lru_head) {
+                    unlink_idle(st, e);
+                    destroy(e);
+                }
+            }
+        }
 
         private:
-        friend class RCPool;
+        friend class KeyedRCPool;
         friend class GetWrapper;
 
-        std::shared_ptr<INST_T> inner_get(uint32_t timeout_s) {
+        static constexpr size_t stripe_count = 16;
+        // lease count flag set once the KeyedRCPool is gone
+        static constexpr size_t owner_gone = ~(~size_t(0) >> 1);
 
-            std::unique_lock<std::mutex> uq_cvlock(cvlock);
-            if (timeout_s) {
-                auto t = cv.wait_until(
-                            uq_cvlock,
-                            std::chrono::steady_clock::now() + std::chrono::seconds(timeout_s),
-                            [this]() -> bool { return resource_available(); }
-                         );
-                if (!t) {
-                    throw ResourceTimedoutException("Timedout");
-                }
+        // like RCPool, the last lease back deletes the pool
+        void retire() {
+            // under each stripe lock, so a put() either sees it or has
+            // idled its entry before the sweep below gets there
+            for (Stripe & st : stripes) {
+                std::lock_guard<std::mutex> lk(st.lock);
+                orphaned = true;
             }
-            else {
-                cv.wait(
-                    uq_cvlock,
-                    [this]() -> bool { return resource_available(); }
-                );
+            while (evict_idle(~size_t(0))) {}
+            if (leases.fetch_or(owner_gone) == 0) {
+                delete this;
             }
+        }
+
+        Entry * acquire(const KEY & key, Deadline deadline) {
+            Stripe & st = stripes[HASH()(key) % stripe_count];
+            leases++;
+            try {
+                for (;;) {
+                    KeyState * ks;
+                    {
+                        std::lock_guard<std::mutex> lk(st.lock);
+                        ks = key_state(st, key);
+                        if (Entry * e = ks->idle) {
+                            unlink_idle(st, e);
+                            ks->out++;
+                            return e;
+                        }
+                        if (reserve()) {
+                            ks->out++;
+                        }
+                        else {
+                            // don't leave an empty key behind if we end
+                            // up timing out
+                            drop_if_unused(st, ks);
+                            ks = nullptr;
+                        }
+                    }
+                    if (ks) return create(st, ks);
 
-            std::shared_ptr<INST_T> this_get = nullptr;
+                    // full: take over the unit of the oldest idle one
+                    if (Entry * v = evict_one()) {
+                        destroy(v);
+                        {
+                            std::lock_guard<std::mutex> lk(st.lock);
+                            try {
+                                ks = key_state(st, key);
+                            }
+                            catch (...) {
+                                release_unit();
+                                throw;
+                            }
+                            ks->out++;
+                        }
+                        return create(st, ks);
+                    }
 
-            if (unused.size()) {
-                this_get = unused.begin()->second;
-                unused.erase(unused.begin());
+                    if (!wait_for(deadline)) {
+                        throw detail::ResourceTimedoutException("Timedout");
+                    }
+                }
             }
-            else {
-                try {
-                    this_get = factory();
+            catch (...) {
+                leases--;
+                throw;
+            }
+        }
+
+        void put(Entry * e) {
+            KeyState * ks = e->ks;
+            Stripe & st = *ks->stripe;
+            bool keep;
+            {
+                std::lock_guard<std::mutex> lk(st.lock);
+                ks->out--;
+                keep = !orphaned && ks->idle_n < idle_per_key;
+                if (keep) {
+                    push_idle(st, e);
                 }
-                catch (const std::exception & e) {
-                    // wrap throw
-                    throw GenericResourceException(e.what());
+                else {
+                    e->ks = nullptr;
+                    drop_if_unused(st, ks);
                 }
-                cur_sz++;
             }
+            if (keep) {
+                wake();
+            }
+            else {
+                destroy(e);
+                release_unit();
+            }
+            if (leases.fetch_sub(1) == (owner_gone | 1)) {
+                delete this;
+            }
+        }
+
+        // build into a unit reserved for ks, unlocked; ks stays put while
+        // its out count is raised
+        Entry * create(Stripe & st, KeyState * ks) {
+            Entry * e = nullptr;
+            try {
+                e = new Entry();
+                e->inst = factory(e->raw, *ks->key);
+                e->ks = ks;
+                return e;
+            }
+            catch (const std::exception & ex) {
+                give_back(st, ks, e);
+                // wrap throw
+                throw detail::GenericResourceException(ex.what());
+            }
+            catch (...) {
+                give_back(st, ks, e);
+                throw;
+            }
+        }
 
-            used.emplace(this_get.get(), this_get);
+        void give_back(Stripe & st, KeyState * ks, Entry * e) {
+            delete e;
+            {
+                std::lock_guard<std::mutex> lk(st.lock);
+                ks->out--;
+                drop_if_unused(st, ks);
+            }
+            release_unit();
+        }
 
-            return this_get;
+        void destroy(Entry * e) {
+            if (e->inst) {
+                e->inst->~INST_T();
+            }
+            delete e;
         }
 
-        void inner_put(std::shared_ptr<INST_T> ptr) {
-            std::unique_lock<std::mutex> uq_cvlock(cvlock);
-            auto p = used.find(ptr.get());
-            if (p == used.end()) return;
+        // under st.lock
+        KeyState * key_state(Stripe & st, const KEY & key) {
+            auto it = st.keys.find(key);
+            if (it == st.keys.end()) {
+                it = st.keys.emplace(key, std::unique_ptr<KeyState>(new KeyState())).first;
+                it->second->key = &it->first;
+                it->second->stripe = &st;
+            }
+            return it->second.get();
+        }
 
-            // back to used if < idle_limit
-            if (used.size() > idle_limit) {
-                cur_sz--;
+        // under st.lock, keys come and go with their resources
+        void drop_if_unused(Stripe & st, KeyState * ks) {
+            if (!ks->idle_n && !ks->out) {
+                st.keys.erase(*ks->key);
             }
-            else {
-                unused.emplace(p->second.get(), ptr);
+        }
+
+        // under st.lock
+        void push_idle(Stripe & st, Entry * e) {
+            KeyState * ks = e->ks;
+            e->idle_since = std::chrono::steady_clock::now();
+            e->key_prev = nullptr;
+            e->key_next = ks->idle;
+            if (ks->idle) ks->idle->key_prev = e;
+            ks->idle = e;
+            ks->idle_n++;
+            e->lru_prev = nullptr;
+            e->lru_next = st.lru_head;
+            (st.lru_head ? st.lru_head->lru_prev : st.lru_tail) = e;
+            st.lru_head = e;
+            idle_total++;
+        }
+
+        // under st.lock
+        void unlink_idle(Stripe & st, Entry * e) {
+            KeyState * ks = e->ks;
+            (e->key_prev ? e->key_prev->key_next : ks->idle) = e->key_next;
+            if (e->key_next) e->key_next->key_prev = e->key_prev;
+            ks->idle_n--;
+            (e->lru_prev ? e->lru_prev->lru_next : st.lru_head) = e->lru_next;
+            (e->lru_next ? e->lru_next->lru_prev : st.lru_tail) = e->lru_prev;
+            idle_total--;
+        }
+
+        // Each stripe's LRU list is ordered by idle_since, so the oldest
+        // of their tails is the pool's least recently used idle entry.
+        // Unlinked and detached from its key, still counted in total.
+        Entry * evict_one() {
+            while (idle_total.load()) {
+                Stripe * best = nullptr;
+                Deadline oldest = Deadline::max();
+                for (Stripe & s : stripes) {
+                    std::lock_guard<std::mutex> lk(s.lock);
+                    if (s.lru_tail && s.lru_tail->idle_since <= oldest) {
+                        oldest = s.lru_tail->idle_since;
+                        best = &s;
+                    }
+                }
+                if (!best) return nullptr;
+
+                std::lock_guard<std::mutex> lk(best->lock);
+                // taken meanwhile, look again
+                Entry * e = best->lru_tail;
+                if (!e) continue;
+                KeyState * ks = e->ks;
+                unlink_idle(*best, e);
+                e->ks = nullptr;
+                drop_if_unused(*best, ks);
+                return e;
             }
+            return nullptr;
+        }
 
-            // erase from used
-            used.erase(p);
+        size_t evict_idle(size_t n) {
+            size_t k = 0;
+            for (; k < n; k++) {
+                Entry * e = evict_one();
+                if (!e) break;
+                destroy(e);
+                release_unit();
+            }
+            return k;
+        }
 
-            uq_cvlock.unlock();
-            cv.notify_one();
+        size_t key_count() {
+            size_t n = 0;
+            for (Stripe & s : stripes) {
+                std::lock_guard<std::mutex> lk(s.lock);
+                n += s.keys.size();
+            }
+            return n;
         }
 
-        bool resource_available() {
-            return cur_sz < max_limit;
+        bool reserve() {
+            size_t t = total.load();
+            while (t < max_limit) {
+                if (total.compare_exchange_weak(t, t + 1)) return true;
+            }
+            return false;
         }
 
-        size_t idle_limit;
-        size_t max_limit;
-        size_t cur_sz;
-        std::mutex cvlock;
-        std::condition_variable cv;
-        std::unordered_map<INST_T *, std::shared_ptr<INST_T>> used;
-        std::unordered_map<INST_T *, std::shared_ptr<INST_T>> unused;
-        std::function<std::shared_ptr<INST_T>()> factory;
+        void release_unit() {
+            total--;
+            wake();
+        }
+
+        // any waiter can use a freed unit or idle entry, evicting it if
+        // it belongs to another key
+        void wake() {
+            if (waiters.load()) {
+                std::lock_guard<std::mutex> lk(wait_lock);
+                wait_cv.notify_one();
+            }
+        }
+
+        // false once deadline passes with nothing idle and no room
+        bool wait_for(Deadline deadline) {
+            std::unique_lock<std::mutex> lk(wait_lock);
+            waiters++;
+            bool ok = true;
+            while (ok && !idle_total.load() && total.load() >= max_limit) {
+                if (deadline == Deadline::max()) {
+                    wait_cv.wait(lk);
+                }
+                else {
+                    ok = deadline > std::chrono::steady_clock::now() &&
+                        wait_cv.wait_until(lk, deadline) == std::cv_status::no_timeout;
+                }
+            }
+            waiters--;
+            if (!ok) {
+                // pass on a wakeup we may have swallowed
+                wait_cv.notify_one();
+            }
+            return ok || idle_total.load() || total.load() < max_limit;
+        }
+
+        const size_t idle_per_key;
+        const size_t max_limit;
+        detail::ArgsCreator<INST_T, KEY> factory;
+        std::array<Stripe, stripe_count> stripes;
+        std::atomic<size_t> total{0};
+        std::atomic<size_t> idle_total{0};
+        std::atomic<size_t> leases{0};
+        std::atomic<bool> orphaned{false};
+        // blocked gets, woken by puts and destroys
+        std::mutex wait_lock;
+        std::condition_variable wait_cv;
+        std::atomic<size_t> waiters{0};
     };
 
-    std::shared_ptr<InnerRCPool> inner_pool_;
+    Inner * inner_;
 };
+
+// One resource from each of several pools (RCPool or ShardedRCPool), or
+// none. Nothing is held while waiting: each round try_get()s the pools,
+// the one that came up short last round first and then the others in
+// the order given, and hands back what it took if one comes up short,
+// then sleeps until any of them releases something. Threads naming the
+// same pools in different orders can't deadlock each other. On failure
+// every handle is empty and carries the status that stopped it.
+template <class... Pools>
+std::tuple<typename Pools::GetWrapper...> acquire_all(std::chrono::steady_clock::time_point deadline, Pools &... pools)
+{
+    static_assert(sizeof...(Pools) > 0, "acquire_all() needs a pool");
+    using Result = std::tuple<typename Pools::GetWrapper...>;
+    using Status = decltype(std::declval<std::tuple_element_t<0, Result> &>().err());
+
+    Result got{ typename Pools::GetWrapper(nullptr, nullptr, Pools::GetStatus::TIMEOUT)... };
+    Status err = Status::TIMEOUT;
+    auto take = [&err](auto & w, auto & pool) -> bool {
+        w = pool.try_get();
+        if (!w) err = static_cast<Status>(static_cast<int>(w.err()));
+        return bool(w);
+    };
+
+    // Trying the short one first, a round that can't succeed takes
+    // nothing, so no hand-back pokes the watch and wakes us right away.
+    size_t first = 0;
+    size_t short_at = 0;
+    auto take_all = [&](auto &... w) {
+        size_t i = 0;
+        if (!(... && (i++ != first || take(w, pools) || (short_at = first, false)))) return false;
+        i = 0;
+        return (... && (i++ == first || take(w, pools) || (short_at = i - 1, false)));
+    };
+
+    RCPoolWatch watch;
+    bool watching = false;
+    try {
+        for (;;) {
+            uint64_t seen = watch.generation();
+            if (std::apply(take_all, got)) break;
+            first = short_at;
+
+            // hand back what we took before waiting on the rest
+            got = Result{ typename Pools::GetWrapper(nullptr, nullptr, Pools::GetStatus::TIMEOUT)... };
+            if (err != Status::TIMEOUT) break;
+            if (!watching) {
+                if (std::chrono::steady_clock::now() >= deadline) break;
+                // look again once attached, a release may have slipped by
+                watching = true;
+                (watch.attach(pools), ...);
+                continue;
+            }
+            if (!watch.wait(seen, deadline)) break;
+        }
+    }
+    catch (...) {
+        err = Status::UNKNOWN;
+    }
+    if (watching) {
+        (watch.detach(pools), ...);
+    }
+    if (std::get<0>(got)) return got;
+    return Result{ typename Pools::GetWrapper(nullptr, nullptr,
+        static_cast<typename Pools::GetStatus>(static_cast<int>(err)))... };
+}
+
+// waits at most timeout, zero or less doesn't wait at all
+template <class Rep, class Period, class... Pools>
+std::tuple<typename Pools::GetWrapper...> acquire_all(std::chrono::duration<Rep, Period> timeout, Pools &... pools)
+{
+    using Deadline = std::chrono::steady_clock::time_point;
+    auto now = std::chrono::steady_clock::now();
+    Deadline d = now;
+    // as RCPool::get(), huge timeouts compare in floating point
+    if (std::chrono::duration<double>(timeout) >= std::chrono::duration<double>(Deadline::max() - now)) {
+        d = Deadline::max();
+    }
+    else if (timeout > timeout.zero()) {
+        d = now + std::chrono::ceil<std::chrono::steady_clock::duration>(timeout);
+    }
+    return acquire_all(d, pools...);
+}
+
+// waits forever
+template <class... Pools>
+std::tuple<typename Pools::GetWrapper...> acquire_all(Pools &... pools)
+{
+    return acquire_all(std::chrono::steady_clock::time_point::max(), pools...);
+}
+
+// never waits
+template <class... Pools>
+std::tuple<typename Pools::GetWrapper...> try_acquire_all(Pools &... pools)
+{
+    return acquire_all(std::chrono::steady_clock::time_point::min(), pools...);
+}
 }
 #endif
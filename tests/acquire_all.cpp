@@ -0,0 +1,161 @@
+// acquire_all(): one from each pool or none, nothing held while it
+// waits, and woken by a release in whichever pool came up short.
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+struct Res {
+    int uses = 0;
+};
+
+struct Flaky {
+    Flaky() {
+        if (failing) throw std::runtime_error("refused");
+    }
+
+    static std::atomic<bool> failing;
+};
+
+std::atomic<bool> Flaky::failing{false};
+
+using A = RCPool<Res>;
+using B = RCPool<Res, LockFreeRCPoolPolicy>;
+using Status = A::GetStatus;
+
+const std::chrono::milliseconds prompt(500);
+const std::chrono::seconds patient(10);
+
+void rolls_back() {
+    A a(1, 1);
+    B b(1, 1);
+    B::GetWrapper held = b.get();
+
+    auto got = try_acquire_all(a, b);
+    check(!std::get<0>(got) && !std::get<1>(got), "try_acquire_all took one of two");
+    check(std::get<0>(got).err() == Status::TIMEOUT && std::get<1>(got).err() == B::GetStatus::TIMEOUT,
+        "short pool didn't report TIMEOUT");
+    check(a.in_use() == 0, "first pool's lease kept after a rollback");
+
+    auto t0 = std::chrono::steady_clock::now();
+    got = acquire_all(std::chrono::milliseconds(20), a, b);
+    check(!std::get<0>(got) && !std::get<1>(got), "acquire_all took one of two");
+    check(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(20), "gave up before the deadline");
+    check(a.in_use() == 0, "first pool's lease kept after timing out");
+}
+
+// a failing factory in the second pool stops it, with CTORF
+void rolls_back_on_failure() {
+    A a(1, 1);
+    RCPool<Flaky> f(1, 1);
+    Flaky::failing = true;
+    auto got = acquire_all(patient, a, f);
+    Flaky::failing = false;
+    check(!std::get<0>(got) && !std::get<1>(got), "acquire_all took one of two");
+    check(std::get<1>(got).err() == RCPool<Flaky>::GetStatus::CTORF, "factory failure not reported as CTORF");
+    check(a.in_use() == 0, "first pool's lease kept after a failure");
+}
+
+// the waiter holds nothing of the first pool, and wakes when the second
+// frees up
+void woken_by_second() {
+    A a(1, 1);
+    B b(1, 1);
+    B::GetWrapper held = b.get();
+
+    std::atomic<bool> done{false};
+    std::thread t([&] {
+        auto got = acquire_all(patient, a, b);
+        check(std::get<0>(got) && std::get<1>(got), "acquire_all failed after the release");
+        done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check(!done, "served with the second pool full");
+    {
+        A::GetWrapper g = a.try_get();
+        check(bool(g), "waiter holds the first pool's resource");
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::thread([&] { held = B::GetWrapper(nullptr, nullptr, B::GetStatus::UNKNOWN); }).join();
+    while (!done && std::chrono::steady_clock::now() - t0 < prompt) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    check(done, "release in the second pool didn't wake the waiter");
+    t.join();
+    check(a.in_use() == 0 && b.in_use() == 0, "leases out after the waiter returned");
+}
+
+// same again, with a sharded pool short and the first freed last
+void woken_by_sharded() {
+    ShardedRCPool<Res> s(2, 2, 2);
+    A a(1, 1);
+    std::vector<ShardedRCPool<Res>::GetWrapper> held;
+    held.push_back(s.get());
+    held.push_back(s.get());
+    A::GetWrapper ha = a.get();
+
+    std::atomic<bool> done{false};
+    std::thread t([&] {
+        auto got = acquire_all(patient, s, a);
+        check(std::get<0>(got) && std::get<1>(got), "acquire_all failed after the releases");
+        done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread([&] { held.pop_back(); }).join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    check(!done, "served with the second pool full");
+    auto t0 = std::chrono::steady_clock::now();
+    std::thread([&] { ha = A::GetWrapper(nullptr, nullptr, Status::UNKNOWN); }).join();
+    while (!done && std::chrono::steady_clock::now() - t0 < prompt) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    check(done, "release didn't wake the waiter");
+    t.join();
+}
+
+// two threads naming the same pools in opposite orders never deadlock
+void opposite_orders() {
+    A a(1, 1);
+    B b(1, 1);
+    std::atomic<long> served{0};
+    std::vector<std::thread> ts;
+    for (int t = 0; t < 4; t++) {
+        ts.emplace_back([&, t] {
+            for (int i = 0; i < 2000; i++) {
+                if (t % 2) {
+                    auto got = acquire_all(patient, a, b);
+                    check(std::get<0>(got) && std::get<1>(got), "a, b timed out");
+                }
+                else {
+                    auto got = acquire_all(patient, b, a);
+                    check(std::get<0>(got) && std::get<1>(got), "b, a timed out");
+                }
+                served++;
+            }
+        });
+    }
+    for (auto & t : ts) t.join();
+    check(served == 8000, "not every acquire_all served");
+    check(a.in_use() == 0 && b.in_use() == 0, "leases out after join");
+}
+
+} // namespace
+
+int main() {
+    rolls_back();
+    rolls_back_on_failure();
+    woken_by_second();
+    woken_by_sharded();
+    opposite_orders();
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,225 @@
+// async_get(): deadlines, cancel(), completion on a release, and a
+// handle dropped before the request completes.
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+struct Res {
+    int id = 0;
+};
+
+using Pool = RCPool<Res>;
+using Status = Pool::GetStatus;
+
+const std::chrono::milliseconds prompt(500);
+
+// Runs what the pool hands it on a thread of its own and records each
+// callback's outcome; leases are dropped on that thread.
+class Loop {
+public:
+    Loop() : t([this] { run(); }) {}
+
+    ~Loop() {
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            stop = true;
+        }
+        cv.notify_all();
+        t.join();
+    }
+
+    Pool::Executor executor() {
+        return [this](std::function<void()> fn) {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                q.push_back(std::move(fn));
+            }
+            cv.notify_all();
+        };
+    }
+
+    Pool::GetCallback record() {
+        return [this](Pool::GetWrapper g) {
+            check(std::this_thread::get_id() == t.get_id(), "callback not run on the executor");
+            std::lock_guard<std::mutex> lk(lock);
+            results.push_back(g ? Status::SUCCESS : g.err());
+            cv.notify_all();
+        };
+    }
+
+    // the n-th outcome, UNKNOWN if it doesn't come within limit
+    Status outcome(size_t n, std::chrono::milliseconds limit = prompt) {
+        std::unique_lock<std::mutex> lk(lock);
+        cv.wait_for(lk, limit, [&] { return results.size() > n; });
+        return results.size() > n ? results[n] : Status::UNKNOWN;
+    }
+
+    size_t outcomes() {
+        std::lock_guard<std::mutex> lk(lock);
+        return results.size();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lk(lock);
+        for (;;) {
+            cv.wait(lk, [&] { return stop || !q.empty(); });
+            if (q.empty()) return;
+            std::function<void()> fn = std::move(q.front());
+            q.pop_front();
+            lk.unlock();
+            fn();
+            lk.lock();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> q;
+    std::vector<Status> results;
+    bool stop = false;
+    std::thread t;
+};
+
+void served_at_once() {
+    Loop loop;
+    Pool p(1, 1);
+    p.async_get(loop.executor(), loop.record());
+    check(loop.outcome(0) == Status::SUCCESS, "idle pool didn't serve");
+}
+
+void times_out() {
+    Loop loop;
+    Pool p(1, 1);
+    Pool::GetWrapper held = p.get();
+    auto asked = std::chrono::milliseconds(30);
+    auto t0 = std::chrono::steady_clock::now();
+    Pool::AsyncGet h = p.async_get(loop.executor(), loop.record(), asked);
+    check(loop.outcome(0, asked + prompt) == Status::TIMEOUT, "no TIMEOUT delivered");
+    auto waited = std::chrono::steady_clock::now() - t0;
+    check(waited >= asked, "TIMEOUT before the deadline");
+    check(!h.cancel(), "cancel() after the deadline");
+    // a release now mustn't deliver again
+    held = Pool::GetWrapper(nullptr, nullptr, Status::UNKNOWN);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    check(loop.outcomes() == 1, "timed out request delivered twice");
+}
+
+void cancelled() {
+    Loop loop;
+    Pool p(1, 1);
+    Pool::GetWrapper held = p.get();
+    Pool::AsyncGet h = p.async_get(loop.executor(), loop.record());
+    check(h.cancel(), "cancel() of a pending request failed");
+    check(!h.cancel(), "second cancel() succeeded");
+    check(loop.outcome(0) == Status::CANCELED, "no CANCELED delivered");
+    held = Pool::GetWrapper(nullptr, nullptr, Status::UNKNOWN);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    check(loop.outcomes() == 1, "cancelled request delivered twice");
+    // the release went to the pool, not the cancelled request
+    Pool::GetWrapper g = p.try_get();
+    check(bool(g), "cancelled request kept the resource");
+}
+
+// cancel() racing a release from another thread: exactly one outcome
+void cancel_races_release() {
+    Loop loop;
+    Pool p(1, 1);
+    for (size_t i = 0; i < 200; i++) {
+        Pool::GetWrapper held = p.get();
+        Pool::AsyncGet h = p.async_get(loop.executor(), loop.record());
+        std::thread rel([&] { held = Pool::GetWrapper(nullptr, nullptr, Status::UNKNOWN); });
+        bool won = h.cancel();
+        rel.join();
+        Status s = loop.outcome(i);
+        check(s == (won ? Status::CANCELED : Status::SUCCESS),
+            "cancel() returned " + std::string(won ? "true" : "false") + " but got " + Pool::explain(s));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    check(loop.outcomes() == 200, "an outcome delivered twice");
+}
+
+void served_on_release() {
+    Loop loop;
+    Pool p(1, 1);
+    Pool::GetWrapper held = p.get();
+    Pool::AsyncGet h = p.async_get(loop.executor(), loop.record());
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    check(loop.outcomes() == 0, "served with nothing free");
+    std::thread([&] { held = Pool::GetWrapper(nullptr, nullptr, Status::UNKNOWN); }).join();
+    check(loop.outcome(0) == Status::SUCCESS, "release didn't serve the request");
+    check(!h.cancel(), "cancel() after being served");
+}
+
+// several pending, served in arrival order as resources come back
+void served_in_order() {
+    Loop loop;
+    Pool p(2, 2);
+    std::vector<Pool::GetWrapper> held;
+    held.push_back(p.get());
+    held.push_back(p.get());
+    std::vector<int> order;
+    std::mutex ol;
+    std::vector<Pool::AsyncGet> hs;
+    for (int i = 0; i < 4; i++) {
+        hs.push_back(p.async_get(loop.executor(), [&, i](Pool::GetWrapper g) {
+            check(bool(g), "pending request failed");
+            std::lock_guard<std::mutex> lk(ol);
+            order.push_back(i);
+        }));
+    }
+    held.clear();
+    auto until = std::chrono::steady_clock::now() + prompt;
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lk(ol);
+            if (order.size() == 4) break;
+        }
+        check(std::chrono::steady_clock::now() < until, "pending requests not all served");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // the first two served first, the others once their leases are
+    // dropped on the loop
+    check(order[0] < 2 && order[1] < 2 && order[2] >= 2 && order[3] >= 2, "served out of order");
+}
+
+void handle_dropped() {
+    Loop loop;
+    Pool p(1, 1);
+    Pool::GetWrapper held = p.get();
+    {
+        Pool::AsyncGet h = p.async_get(loop.executor(), loop.record());
+    }
+    held = Pool::GetWrapper(nullptr, nullptr, Status::UNKNOWN);
+    check(loop.outcome(0) == Status::SUCCESS, "request lost with its handle");
+
+    // and one that times out with no handle left
+    held = p.get();
+    p.async_get(loop.executor(), loop.record(), std::chrono::milliseconds(10));
+    check(loop.outcome(1) == Status::TIMEOUT, "handle-less request never timed out");
+}
+
+} // namespace
+
+int main() {
+    served_at_once();
+    times_out();
+    cancelled();
+    cancel_races_release();
+    served_on_release();
+    served_in_order();
+    handle_dropped();
+    std::printf("ok\n");
+    return 0;
+}
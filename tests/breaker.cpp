@@ -0,0 +1,123 @@
+// The circuit breaker: it opens after the configured construction
+// failures in a row, fails gets with CIRCUIT_OPEN without calling the
+// factory, still hands out idle resources, reopens when a probe fails
+// and closes once one succeeds.
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+std::atomic<bool> down{false};
+std::atomic<long> attempts{0};
+
+struct Conn {
+    Conn() {
+        attempts++;
+        if (down) throw std::runtime_error("refused");
+    }
+};
+
+template <class POLICY>
+using Pool = RCPool<Conn, POLICY>;
+
+const std::chrono::milliseconds backoff(50);
+const std::chrono::milliseconds prompt(500);
+
+template <class P>
+bool open_within(P & p, bool open, std::chrono::milliseconds limit) {
+    auto until = std::chrono::steady_clock::now() + limit;
+    while (p.breaker_open() != open) {
+        if (std::chrono::steady_clock::now() >= until) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+template <class POLICY>
+void trips_and_recovers(const std::string & name) {
+    using P = Pool<POLICY>;
+    using Status = typename P::GetStatus;
+    down = false;
+    attempts = 0;
+    P p(2, 4);
+    RCPoolBreaker b;
+    b.failures = 3;
+    b.backoff = backoff;
+    b.max_backoff = backoff * 4;
+    b.jitter = 0;
+    p.set_breaker(b);
+
+    // one idle resource to hand out while open
+    p.get();
+    check(p.size() == 1, name + ": not built");
+
+    typename P::GetWrapper held = p.get();
+    check(bool(held), name + ": idle one not handed out");
+    down = true;
+    for (size_t i = 0; i < b.failures; i++) {
+        check(!p.breaker_open(), name + ": open after " + std::to_string(i) + " failures");
+        typename P::GetWrapper g = p.try_get();
+        check(!g && g.err() == Status::CTORF, name + ": failing factory didn't give CTORF");
+    }
+    check(p.breaker_open(), name + ": not open after the failures in a row");
+
+    // no factory call while open
+    long before = attempts;
+    for (int i = 0; i < 10; i++) {
+        typename P::GetWrapper g = p.get(std::chrono::milliseconds(1));
+        check(!g && g.err() == Status::CIRCUIT_OPEN, name + ": open breaker didn't give CIRCUIT_OPEN");
+    }
+    check(attempts == before, name + ": factory called while open");
+
+    // the idle one still goes out
+    held = typename P::GetWrapper(nullptr, nullptr, Status::UNKNOWN);
+    {
+        typename P::GetWrapper g = p.try_get();
+        check(bool(g), name + ": idle resource refused while open");
+    }
+
+    // the probe at the end of the backoff fails: open again, for longer
+    auto t0 = std::chrono::steady_clock::now();
+    auto until = t0 + backoff + prompt;
+    while (attempts == before && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    check(attempts == before + 1, name + ": no probe after the backoff");
+    check(std::chrono::steady_clock::now() - t0 >= backoff - std::chrono::milliseconds(5),
+        name + ": probed before the backoff ran out");
+    check(p.breaker_open(), name + ": closed by a failed probe");
+
+    // the next probe succeeds and closes it
+    down = false;
+    check(open_within(p, false, backoff * 2 + prompt), name + ": not closed after a good probe");
+    check(attempts == before + 2, name + ": probed more than once per backoff");
+    // the probe's and the first one, then a build
+    std::vector<typename P::GetWrapper> hold;
+    for (int i = 0; i < 3; i++) {
+        hold.push_back(p.try_get());
+        check(bool(hold.back()), name + ": get failed once closed");
+    }
+    // a failure after closing starts a new count
+    down = true;
+    typename P::GetWrapper f = p.try_get();
+    check(!f && f.err() == Status::CTORF, name + ": failing factory didn't give CTORF");
+    check(!p.breaker_open(), name + ": reopened after a single failure");
+    down = false;
+}
+
+} // namespace
+
+int main() {
+    trips_and_recovers<RCPoolPolicy>("locked");
+    trips_and_recovers<LockFreeRCPoolPolicy>("lockfree");
+    std::printf("ok\n");
+    return 0;
+}
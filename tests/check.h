@@ -0,0 +1,14 @@
+// Shared by the ctest programs: report the first broken invariant and
+// exit non-zero, in release builds too.
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+inline void check(bool ok, const std::string & what) {
+    if (ok) return;
+    std::fprintf(stderr, "FAIL: %s\n", what.c_str());
+    std::exit(1);
+}
@@ -0,0 +1,137 @@
+// How resources get built: ArgsFactory with and without constructor
+// arguments (move-only ones included) for every pool type, the opt-in
+// FunctionFactory, and a factory policy of one's own.
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <memory>
+#include <string>
+
+using namespace mklib;
+
+namespace {
+
+std::atomic<long> live{0};
+
+struct Conn {
+    Conn() : Conn("default", 0) {}
+
+    Conn(const std::string & host_, int port_) : host(host_), port(port_) {
+        live++;
+    }
+
+    Conn(const std::string & key, const std::string & host_, int port_) : Conn(key + "@" + host_, port_) {}
+
+    // built from a key alone, for KeyedRCPool
+    explicit Conn(const std::string & key) : Conn(key, 1) {}
+
+    ~Conn() {
+        live--;
+    }
+
+    std::string host;
+    int port;
+};
+
+// takes its argument by const reference, so a move-only one must stay
+// with the pool
+struct Owner {
+    explicit Owner(const std::unique_ptr<int> & p) : value(*p) {}
+
+    int value;
+};
+
+struct Counting {
+    explicit Counting(int base_) : base(base_) {}
+
+    Conn * create(void * where, const RCPoolSlotInfo & info) {
+        return new (where) Conn("counting", base + static_cast<int>(info.serial));
+    }
+
+    int base;
+};
+
+struct CountingPolicy : RCPoolPolicy {
+    using factory = Counting;
+};
+
+struct FunctionPolicy : RCPoolPolicy {
+    using factory = FunctionFactory<Conn>;
+};
+
+void args() {
+    {
+        RCPool<Conn> p(2, 2);
+        auto g = p.get();
+        check(g->host == "default" && g->port == 0, "no arguments");
+    }
+    {
+        std::string host = "db";
+        RCPool<Conn> p(2, 2, host, 5432);
+        host = "changed";
+        auto a = p.get();
+        auto b = p.get();
+        check(a->host == "db" && a->port == 5432 && b->host == "db", "arguments not kept by value");
+    }
+    {
+        RCPool<Conn, LockFreeRCPoolPolicy> p(2, 2, std::string("cache"), 6379);
+        auto g = p.get();
+        check(g->host == "cache" && g->port == 6379, "lock-free arguments");
+    }
+    {
+        RCPool<Owner> p(2, 2, std::make_unique<int>(7));
+        auto a = p.get();
+        auto b = p.get();
+        check(a->value == 7 && b->value == 7, "move-only argument");
+    }
+    {
+        RCPool<Conn, SingleThreaded> p(2, 2, std::string("local"), 1);
+        auto g = p.get();
+        check(g->host == "local" && g->port == 1, "SingleThreaded arguments");
+    }
+    {
+        RCPool<Conn, Fixed<2>> p(2, 2);
+        auto g = p.get();
+        check(g->host == "default", "Fixed without arguments");
+    }
+    {
+        KeyedRCPool<std::string, Conn> p(1, 4, std::string("db"), 5432);
+        auto g = p.get("tenant");
+        check(g->host == "tenant@db" && g->port == 5432, "keyed arguments after the key");
+    }
+    {
+        KeyedRCPool<std::string, Conn> p(1, 4);
+        auto g = p.get("solo");
+        check(g->host == "solo" && g->port == 1, "keyed without arguments");
+    }
+    check(live == 0, "resources leaked");
+}
+
+void factories() {
+    {
+        RCPool<Conn, CountingPolicy> p(2, 2, 100);
+        auto a = p.get();
+        auto b = p.get();
+        check(a->port == 100 && b->port == 101, "factory policy");
+    }
+    {
+        int made = 0;
+        RCPool<Conn, FunctionPolicy> p(2, 2, [&made](void * where) {
+            return new (where) Conn("fn", ++made);
+        });
+        auto a = p.get();
+        auto b = p.get();
+        check(a->host == "fn" && made == 2, "FunctionFactory");
+    }
+    check(live == 0, "resources leaked");
+}
+
+} // namespace
+
+int main() {
+    args();
+    factories();
+    std::printf("ok\n");
+    return 0;
+}
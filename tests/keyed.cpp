@@ -0,0 +1,80 @@
+// KeyedRCPool: keys come and go with their resources, including after
+// gets on new keys that time out or fail.
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+struct Conn {
+    explicit Conn(const std::string & key_) : key(key_) {
+        if (key.compare(0, 4, "bad-") == 0) throw std::runtime_error("refused");
+    }
+
+    std::string key;
+};
+
+using Pool = KeyedRCPool<std::string, Conn>;
+
+void timed_out_keys() {
+    Pool p(2, 1);
+    {
+        Pool::GetWrapper held = p.get("a");
+        check(bool(held), "first get");
+        for (int i = 0; i < 1000; i++) {
+            Pool::GetWrapper g = p.try_get("k" + std::to_string(i));
+            check(!g && g.err() == Pool::GetStatus::TIMEOUT, "try_get at max_limit");
+        }
+        for (int i = 0; i < 10; i++) {
+            Pool::GetWrapper g = p.get("w" + std::to_string(i), std::chrono::milliseconds(1));
+            check(!g && g.err() == Pool::GetStatus::TIMEOUT, "get at max_limit");
+        }
+        check(p.key_count() == 1, "timed out keys left behind: " + std::to_string(p.key_count()));
+    }
+    // "a" idles on
+    check(p.key_count() == 1, "idle key");
+    p.evict_idle(1);
+    check(p.key_count() == 0, "keys left after evicting: " + std::to_string(p.key_count()));
+}
+
+void failed_keys() {
+    Pool p(2, 4);
+    for (int i = 0; i < 100; i++) {
+        Pool::GetWrapper g = p.try_get("bad-" + std::to_string(i));
+        check(!g && g.err() == Pool::GetStatus::CTORF, "failing factory");
+    }
+    check(p.key_count() == 0, "failed keys left behind: " + std::to_string(p.key_count()));
+}
+
+// many threads, few units, keys churning through eviction and timeouts
+void churn() {
+    Pool p(1, 4);
+    std::vector<std::thread> ts;
+    for (int t = 0; t < 8; t++) {
+        ts.emplace_back([&p, t] {
+            for (int i = 0; i < 2000; i++) {
+                Pool::GetWrapper g = p.get("k" + std::to_string((t * 7 + i) % 32), std::chrono::microseconds(200));
+                if (g) check(g->key.size() > 1, "wrong resource");
+            }
+        });
+    }
+    for (auto & t : ts) t.join();
+    p.evict_idle(~size_t(0));
+    check(p.key_count() == 0, "keys left after churn: " + std::to_string(p.key_count()));
+}
+
+} // namespace
+
+int main() {
+    timed_out_keys();
+    failed_keys();
+    churn();
+    std::printf("ok\n");
+    return 0;
+}
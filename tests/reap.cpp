@@ -0,0 +1,162 @@
+// The keeper's idle upkeep: idle resources go once stale, min_idle
+// holds some back, a try_get never fails for lack of an idle resource
+// while the keeper is looking them over, shrunk ones kept past
+// idle_limit only while an idle ttl can age them out, and warm() without
+// an executor builds several at once.
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+struct Res {
+    long uses = 0;
+};
+
+// a connect that takes a while
+struct Slow {
+    Slow() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+};
+
+template <class Pool>
+bool size_within(Pool & p, size_t lo, size_t hi, std::chrono::milliseconds limit) {
+    auto until = std::chrono::steady_clock::now() + limit;
+    while (std::chrono::steady_clock::now() < until) {
+        size_t n = p.size();
+        if (n >= lo && n <= hi) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+}
+
+template <class Pool>
+void fill(Pool & p, size_t n) {
+    std::vector<typename Pool::GetWrapper> held;
+    for (size_t i = 0; i < n; i++) {
+        held.push_back(p.try_get());
+        check(bool(held.back()), "couldn't fill the pool");
+    }
+}
+
+template <class POLICY>
+void expiry(const std::string & name) {
+    using Pool = RCPool<Res, POLICY>;
+    Pool p(8, 8);
+    p.set_idle_ttl(std::chrono::milliseconds(20));
+    fill(p, 8);
+    check(size_within(p, 0, 0, std::chrono::seconds(2)), name + ": stale ones not reaped");
+
+    // one idled long after the last reap still goes
+    fill(p, 1);
+    check(p.size() == 1, name + ": not built");
+    check(size_within(p, 0, 0, std::chrono::seconds(2)), name + ": late one not reaped");
+
+    // min_idle holds some back until lowered
+    p.set_min_idle(2);
+    check(size_within(p, 2, 2, std::chrono::seconds(2)), name + ": min_idle not refilled");
+    fill(p, 6);
+    check(size_within(p, 2, 2, std::chrono::seconds(2)), name + ": reaped into min_idle");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    check(p.size() == 2, name + ": min_idle ones reaped");
+    p.set_min_idle(0);
+    check(size_within(p, 0, 0, std::chrono::seconds(2)), name + ": not reaped after lowering min_idle");
+}
+
+// At max_limit with every resource idle and none of them stale yet, the
+// keeper ticks a few times per ttl while try_get hammers the pool; none
+// may fail, as something is always idle.
+template <class POLICY>
+void try_get_while_reaping(const std::string & name) {
+    using Pool = RCPool<Res, POLICY>;
+    const size_t n = 64;
+    const auto ttl = std::chrono::milliseconds(200);
+    for (int round = 0; round < 4; round++) {
+        Pool p(n, n);
+        fill(p, n);
+        p.set_idle_ttl(ttl);
+
+        std::atomic<long> failed{0};
+        std::atomic<long> served{0};
+        auto until = std::chrono::steady_clock::now() + ttl * 3 / 4;
+        std::vector<std::thread> ts;
+        for (int t = 0; t < 4; t++) {
+            ts.emplace_back([&] {
+                while (std::chrono::steady_clock::now() < until) {
+                    typename Pool::GetWrapper g = p.try_get();
+                    if (g) {
+                        g->uses++;
+                        served++;
+                    }
+                    else {
+                        failed++;
+                    }
+                }
+            });
+        }
+        for (auto & t : ts) t.join();
+        check(served > 0, name + ": nothing served");
+        check(failed == 0, name + ": " + std::to_string(failed.load()) + " try_gets failed with idle ones in the pool");
+    }
+}
+
+// eight 50ms builds by the keeper, refill_threads = 4 at a time
+// set_shrink() keeps returns past idle_limit only with an idle ttl
+template <class POLICY>
+void shrink_needs_ttl(const std::string & name) {
+    using Pool = RCPool<Res, POLICY>;
+    Pool p(1, 4);
+    std::atomic<int> shrunk{0};
+    p.set_shrink([&](Res &) {
+        shrunk++;
+        return true;
+    });
+    fill(p, 4);
+    check(p.size() == 1, name + ": kept past idle_limit without a ttl");
+    check(shrunk == 0, name + ": shrunk ones about to go");
+
+    p.set_idle_ttl(std::chrono::hours(1));
+    fill(p, 4);
+    check(p.size() == 4, name + ": shrunk ones not kept with a ttl");
+    check(shrunk == 3, name + ": not shrunk past idle_limit");
+
+    // nothing would age them out any more
+    p.set_idle_ttl(std::chrono::milliseconds(0));
+    check(size_within(p, 1, 1, std::chrono::seconds(2)), name + ": not trimmed once the ttl was cleared");
+}
+
+void warm_in_parallel() {
+    RCPool<Slow> p(8, 8);
+    auto t0 = std::chrono::steady_clock::now();
+    check(p.warm(8) == 8, "warm: not building");
+    // size() counts them from the start, wait for them to idle
+    while (p.snapshot().idle < 8 && std::chrono::steady_clock::now() - t0 < std::chrono::seconds(2)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto took = std::chrono::steady_clock::now() - t0;
+    check(p.snapshot().idle == 8, "warm: not built");
+    check(took < std::chrono::milliseconds(300), "warm: built one at a time, took " +
+        std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(took).count()) + "ms");
+}
+
+} // namespace
+
+int main() {
+    expiry<RCPoolPolicy>("locked");
+    expiry<LockFreeRCPoolPolicy>("lockfree");
+    try_get_while_reaping<RCPoolPolicy>("locked");
+    try_get_while_reaping<LockFreeRCPoolPolicy>("lockfree");
+    shrink_needs_ttl<RCPoolPolicy>("locked");
+    shrink_needs_ttl<LockFreeRCPoolPolicy>("lockfree");
+    warm_in_parallel();
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,508 @@
+// Stress and scaling harness for rcpool.h: every pool flavour under a
+// mix of gets with short deadlines, HIGH priority gets into a reserve,
+// get_n() batches, async gets cancelled or left to time out, factory
+// failures, leases handed between threads and deferred releases, at
+// growing thread counts. Construction takes a while and a few leases
+// are held for a long-tailed time, as with real connections. One
+// flavour runs with idle ttl, min_idle, warm(), autosize, the breaker
+// and a hold watch all on. acquire_all() and the single-threaded pools
+// get phases of their own. Exits non-zero on the first broken invariant.
+//
+//   rcpool_stress [ops per run] [max threads] [build us]
+
+#include "rcpool.h"
+#include "check.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mklib;
+
+namespace {
+
+const size_t idle_limit = 4;
+const size_t max_limit = 16;
+// no lease is held for long, so a get this patient only times out when
+// a wakeup went missing
+const std::chrono::seconds patient(10);
+// deadline for the bounded wakeup checks
+const std::chrono::milliseconds prompt(500);
+// the longest a sampled hold may sleep
+const std::chrono::microseconds longest_hold(5000);
+
+std::atomic<long> live{0};
+std::chrono::microseconds build_time(20);
+
+// one construction in twenty throws, the rest take build_time
+struct Res {
+    Res() {
+        static thread_local std::minstd_rand r(
+            static_cast<unsigned>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+        if (r() % 20 == 0) throw std::runtime_error("injected factory failure");
+        if (build_time.count()) std::this_thread::sleep_for(build_time);
+        live++;
+    }
+
+    ~Res() {
+        live--;
+    }
+
+    // disallow copy
+    Res(const Res & rhs) = delete;
+    Res & operator=(const Res & rhs) = delete;
+
+    long uses = 0;
+};
+
+// a resource that never fails, for the wakeup checks
+struct Plain {
+    long uses = 0;
+};
+
+struct Fair : RCPoolPolicy {
+    static constexpr bool fair = true;
+};
+
+struct Cached : RCPoolPolicy {
+    static constexpr size_t thread_cache = 4;
+};
+
+struct Bitmap : LockFreeRCPoolPolicy {
+    using storage = BitmapStorage;
+};
+
+struct Arena : RCPoolPolicy {
+    using storage = ArenaStorage;
+};
+
+struct Watched : RCPoolPolicy {
+    static constexpr bool hold_watch = true;
+};
+
+// Mostly short, now and then long: a lognormal hold with a median of
+// 20us, capped at longest_hold.
+std::chrono::microseconds sample_hold(std::minstd_rand & r) {
+    static thread_local std::lognormal_distribution<double> d(std::log(20.0), 1.5);
+    return std::min(longest_hold, std::chrono::microseconds(static_cast<long>(d(r))));
+}
+
+struct Counts {
+    std::atomic<long> ops{0};
+    std::atomic<long> timeouts{0};
+    std::atomic<long> failures{0};
+    std::atomic<long> moved{0};
+    std::atomic<long> batches{0};
+    std::atomic<long> async_started{0};
+    std::atomic<long> async_done{0};
+    std::atomic<long> async_served{0};
+};
+
+// what every flavour looks like to the harness
+template <class POLICY>
+struct Single {
+    using Pool = RCPool<Res, POLICY>;
+    Pool pool{idle_limit, max_limit};
+
+    Single() {
+        // one unit for HIGH gets alone
+        pool.set_reserved(1);
+    }
+
+    static void flush_released() {
+        Pool::flush_released();
+    }
+
+    size_t in_use() {
+        return pool.in_use();
+    }
+
+    void batch(std::minstd_rand & r, Counts & c) {
+        typename Pool::GetBatch b = pool.get_n(1 + r() % 3, std::chrono::microseconds(r() % 500));
+        if (b) {
+            c.batches++;
+            for (auto & g : b) g->uses++;
+        }
+    }
+
+    // an async get that is cancelled, times out, or is served and
+    // released on the serving thread; the callback must run once
+    void async(std::minstd_rand & r, Counts & c) {
+        c.async_started++;
+        auto h = pool.async_get([](std::function<void()> fn) { fn(); },
+            [&c](typename Pool::GetWrapper g) {
+                if (g) {
+                    g->uses++;
+                    c.async_served++;
+                }
+                c.async_done++;
+            },
+            std::chrono::microseconds(r() % 2000));
+        if (r() % 2) h.cancel();
+    }
+};
+
+// every knob the keeper turns, at once
+struct Tuned : Single<Watched> {
+    std::atomic<long> reported{0};
+
+    Tuned() {
+        pool.set_idle_ttl(std::chrono::milliseconds(5));
+        pool.set_min_idle(2);
+        pool.warm(idle_limit);
+        RCPoolAutoSize a;
+        a.min_limit = idle_limit;
+        a.interval = std::chrono::milliseconds(10);
+        pool.set_autosize(a);
+        RCPoolBreaker b;
+        b.failures = 3;
+        b.backoff = std::chrono::milliseconds(5);
+        pool.set_breaker(b);
+        RCPoolHoldWatch w;
+        w.threshold = std::chrono::milliseconds(2);
+        w.sample_every = 64;
+        pool.set_hold_watch(w, [this](const std::vector<Pool::HeldLease> & held) {
+            reported += static_cast<long>(held.size());
+        });
+    }
+};
+
+template <class POLICY>
+struct Sharded {
+    using Pool = ShardedRCPool<Res, POLICY>;
+    Pool pool{4, idle_limit, max_limit};
+
+    Sharded() {
+        pool.set_reserved(1);
+    }
+
+    static void flush_released() {
+        Pool::flush_released();
+    }
+
+    size_t in_use() {
+        size_t n = 0;
+        for (auto & o : pool.occupancy()) n += o.in_use;
+        return n;
+    }
+
+    // no get_n() or async_get() on a sharded pool
+    void batch(std::minstd_rand &, Counts &) {}
+    void async(std::minstd_rand &, Counts &) {}
+};
+
+template <class Harness>
+void worker(Harness & h, size_t id, long ops, Counts & c,
+    std::mutex & ql, std::deque<typename Harness::Pool::GetWrapper> & q)
+{
+    using Wrapper = typename Harness::Pool::GetWrapper;
+    using Status = typename Harness::Pool::GetStatus;
+    using Priority = typename Harness::Pool::GetPriority;
+    std::minstd_rand r(static_cast<unsigned>(id + 1));
+    Wrapper last(nullptr, nullptr, Status::UNKNOWN);
+    for (long i = 0; i < ops; i++) {
+        // the odd batch or async get, neither waits long
+        unsigned kind = r() % 32;
+        if (kind == 0) {
+            h.batch(r, c);
+            continue;
+        }
+        if (kind == 1) {
+            h.async(r, c);
+            continue;
+        }
+        // hold on to the last lease over a short get now and then, so
+        // deadlines expire once threads outnumber resources; never over
+        // a patient one, that could deadlock
+        bool long_wait = r() % 8 == 0;
+        Wrapper kept(nullptr, nullptr, Status::UNKNOWN);
+        if (!long_wait && r() % 4 == 0) kept = std::move(last);
+        last = Wrapper(nullptr, nullptr, Status::UNKNOWN);
+        // HIGH gets may take the reserved unit, never wait long for it
+        bool high = !long_wait && r() % 16 == 0;
+        Wrapper g = long_wait ? h.pool.get(patient) :
+            h.pool.get(std::chrono::microseconds(r() % 500), high ? Priority::HIGH : Priority::NORMAL);
+        if (!g) {
+            if (g.err() == Status::TIMEOUT) {
+                check(!long_wait, "lost wakeup: a patient get timed out");
+                c.timeouts++;
+            }
+            else {
+                c.failures++;
+            }
+            continue;
+        }
+        c.ops++;
+        g->uses++;
+        if (r() % 16 == 0) {
+            std::this_thread::sleep_for(sample_hold(r));
+        }
+        // park the lease for some other thread to release
+        if (r() % 10 == 0) {
+            std::lock_guard<std::mutex> lk(ql);
+            if (q.size() < 4) q.push_back(std::move(g));
+        }
+        if (r() % 10 == 0) {
+            Wrapper other(nullptr, nullptr, Status::UNKNOWN);
+            {
+                std::lock_guard<std::mutex> lk(ql);
+                if (!q.empty()) {
+                    other = std::move(q.front());
+                    q.pop_front();
+                }
+            }
+            if (other) {
+                c.moved++;
+                if (r() % 2) other.release_later();
+            }
+        }
+        if (g && r() % 4 == 0) {
+            g.release_later();
+        }
+        last = std::move(g);
+    }
+    last = Wrapper(nullptr, nullptr, Status::UNKNOWN);
+    Harness::flush_released();
+}
+
+template <class Harness>
+void run(const char * name, size_t threads, long total_ops) {
+    Counts c;
+    double secs;
+    RCPoolSnapshot s;
+    {
+        Harness h;
+        std::mutex ql;
+        std::deque<typename Harness::Pool::GetWrapper> q;
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> ts;
+        for (size_t t = 0; t < threads; t++) {
+            ts.emplace_back([&, t] {
+                worker(h, t, total_ops / static_cast<long>(threads), c, ql, q);
+            });
+        }
+        for (auto & t : ts) t.join();
+        secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        // parked leases go back from a thread of their own, whose exit
+        // drains any thread cache they land in
+        std::thread([&] { q.clear(); }).join();
+
+        // every async get completes, by its deadline at the latest
+        auto until = std::chrono::steady_clock::now() + prompt;
+        while (c.async_done < c.async_started && std::chrono::steady_clock::now() < until) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        check(c.async_done == c.async_started, std::string(name) + ": " +
+            std::to_string(c.async_started - c.async_done) + " async gets never completed");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        check(c.async_done == c.async_started, std::string(name) + ": async callback ran twice");
+        std::thread([] { Harness::flush_released(); }).join();
+
+        s = h.pool.snapshot();
+        check(s.peak_total <= max_limit, std::string(name) + ": peak_total " +
+            std::to_string(s.peak_total) + " over max_limit");
+        check(h.in_use() == 0, std::string(name) + ": " + std::to_string(h.in_use()) +
+            " leases still out after join");
+        check(s.in_use == 0, std::string(name) + ": snapshot shows leases out after join");
+    }
+    check(live == 0, std::string(name) + ": resources leaked");
+    std::printf("%-10s %3zu threads %10.0f ops/s  peak %2zu  timeouts %6ld  failures %5ld  moved %6ld  batches %5ld  async %5ld/%-5ld\n",
+        name, threads, c.ops / secs, s.peak_total, c.timeouts.load(), c.failures.load(), c.moved.load(),
+        c.batches.load(), c.async_served.load(), c.async_started.load());
+    std::fflush(stdout);
+}
+
+// Threads take one from each of two pools at once, or neither, while
+// others hold single leases; neither pool may be left with one out.
+void pairs(size_t threads, long total_ops) {
+    {
+        RCPool<Res> a(2, 4);
+        RCPool<Res, LockFreeRCPoolPolicy> b(2, 4);
+        std::atomic<long> both{0};
+        std::vector<std::thread> ts;
+        for (size_t t = 0; t < threads; t++) {
+            ts.emplace_back([&, t] {
+                std::minstd_rand r(static_cast<unsigned>(t + 1));
+                for (long i = 0; i < total_ops / static_cast<long>(threads); i++) {
+                    if (r() % 4 == 0) {
+                        auto g = r() % 2 ? a.get(std::chrono::microseconds(r() % 500)) : a.try_get();
+                        if (g && r() % 16 == 0) std::this_thread::sleep_for(sample_hold(r));
+                        continue;
+                    }
+                    auto got = acquire_all(std::chrono::microseconds(r() % 1000), a, b);
+                    check(bool(std::get<0>(got)) == bool(std::get<1>(got)), "acquire_all took one of two");
+                    if (std::get<0>(got)) {
+                        both++;
+                        if (r() % 16 == 0) std::this_thread::sleep_for(sample_hold(r));
+                    }
+                }
+            });
+        }
+        for (auto & t : ts) t.join();
+        check(a.in_use() == 0 && b.in_use() == 0, "acquire_all: leases still out after join");
+        std::printf("pairs      %3zu threads  both %ld\n", threads, both.load());
+    }
+    check(live == 0, "acquire_all: resources leaked");
+}
+
+// RCPool<T, SingleThreaded> and Fixed<N>: random gets and puts from one
+// thread, with the counts checked against a model as they go.
+template <class Pool>
+void single_threaded(const char * name, long ops) {
+    {
+        Pool p(idle_limit, max_limit);
+        std::vector<typename Pool::GetWrapper> held;
+        std::minstd_rand r(7);
+        for (long i = 0; i < ops; i++) {
+            if (held.size() < p.max_limit() && r() % 2) {
+                auto g = p.try_get();
+                if (g) {
+                    g->uses++;
+                    held.push_back(std::move(g));
+                }
+                else {
+                    check(g.err() == Pool::GetStatus::CTORF, std::string(name) + ": get failed with room left");
+                }
+            }
+            else if (!held.empty()) {
+                std::swap(held[r() % held.size()], held.back());
+                held.pop_back();
+            }
+            else {
+                auto g = p.try_get();
+                (void)g;
+            }
+            check(p.in_use() == held.size(), std::string(name) + ": in_use off");
+            check(p.size() <= p.max_limit(), std::string(name) + ": over max_limit");
+        }
+        while (held.size() < p.max_limit()) {
+            auto g = p.try_get();
+            if (g) held.push_back(std::move(g));
+        }
+        auto over = p.try_get();
+        check(!over && over.err() == Pool::GetStatus::TIMEOUT, std::string(name) + ": full pool handed one out");
+        held.clear();
+        check(p.in_use() == 0 && p.size() <= idle_limit, std::string(name) + ": not trimmed to idle_limit");
+    }
+    check(live == 0, std::string(name) + ": resources leaked");
+    std::printf("%-10s ok\n", name);
+}
+
+// With the pool full, a get times out no sooner than asked and not
+// much later. Then every blocked get must be served within prompt of a
+// release, whatever thread or shard the release happens on.
+template <class Pool>
+void check_wakeups(const char * name, Pool & pool, size_t held) {
+    using Wrapper = typename Pool::GetWrapper;
+    std::vector<Wrapper> hold;
+    for (size_t i = 0; i < held; i++) {
+        hold.push_back(pool.get(prompt));
+        check(bool(hold.back()), std::string(name) + ": couldn't fill the pool");
+    }
+
+    auto asked = std::chrono::milliseconds(20);
+    auto t = std::chrono::steady_clock::now();
+    Wrapper late = pool.get(asked);
+    auto waited = std::chrono::steady_clock::now() - t;
+    check(!late && late.err() == Pool::GetStatus::TIMEOUT, std::string(name) + ": full pool didn't time out");
+    check(waited >= asked && waited < asked + prompt, std::string(name) + ": deadline missed");
+
+    const size_t waiters = 4;
+    std::atomic<size_t> served{0};
+    std::vector<std::thread> ts;
+    for (size_t i = 0; i < waiters; i++) {
+        ts.emplace_back([&] {
+            Wrapper g = pool.get(patient);
+            check(bool(g), std::string(name) + ": waiter not served");
+            served++;
+            // pass it on through the release buffer of a thread that
+            // then goes idle, the next waiter must still get it
+            g.release_later();
+            std::this_thread::sleep_for(prompt * 2);
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    auto t0 = std::chrono::steady_clock::now();
+    // released from other threads, one at a time
+    std::thread([&] { hold.pop_back(); }).join();
+    while (served < waiters && std::chrono::steady_clock::now() - t0 < prompt * waiters) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    check(served == waiters, std::string(name) + ": lost wakeup, " +
+        std::to_string(served.load()) + " of " + std::to_string(waiters) + " waiters served");
+    for (auto & t : ts) t.join();
+}
+
+// a blocked sharded get waits on two shards, not on every one of them
+void herd() {
+    ShardedRCPool<Plain> p(8, 8, 8);
+    std::vector<ShardedRCPool<Plain>::GetWrapper> hold;
+    for (size_t i = 0; i < 8; i++) hold.push_back(p.get(prompt));
+    std::thread t([&] {
+        auto g = p.get(patient);
+        check(bool(g), "herd: waiter not served");
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    size_t waiting = p.snapshot().waiters;
+    hold.clear();
+    t.join();
+    check(waiting == 2, "herd: one get waits on " + std::to_string(waiting) + " shards");
+}
+
+void wakeups() {
+    {
+        RCPool<Plain> p(1, 1);
+        check_wakeups("locked", p, 1);
+    }
+    {
+        RCPool<Plain, LockFreeRCPoolPolicy> p(1, 1);
+        check_wakeups("lockfree", p, 1);
+    }
+    {
+        RCPool<Plain, Fair> p(1, 1);
+        check_wakeups("fair", p, 1);
+    }
+    {
+        ShardedRCPool<Plain> p(4, 4, 4);
+        check_wakeups("sharded", p, 4);
+    }
+    {
+        ShardedRCPool<Plain> p(8, 8, 8);
+        check_wakeups("sharded8", p, 8);
+    }
+    herd();
+    std::printf("wakeups ok\n");
+}
+
+} // namespace
+
+int main(int argc, char ** argv) {
+    long ops = argc > 1 ? std::atol(argv[1]) : 100000;
+    size_t max_threads = argc > 2 ? static_cast<size_t>(std::atol(argv[2])) :
+        std::max<size_t>(16, 2 * std::thread::hardware_concurrency());
+    max_threads = std::min<size_t>(max_threads, 64);
+    if (argc > 3) build_time = std::chrono::microseconds(std::atol(argv[3]));
+
+    wakeups();
+    single_threaded<RCPool<Res, SingleThreaded>>("single", ops);
+    single_threaded<RCPool<Res, Fixed<max_limit>>>("fixed", ops);
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        run<Single<RCPoolPolicy>>("locked", n, ops);
+        run<Single<LockFreeRCPoolPolicy>>("lockfree", n, ops);
+        run<Single<Fair>>("fair", n, ops);
+        run<Single<Cached>>("cached", n, ops);
+        run<Single<Arena>>("arena", n, ops);
+        run<Single<Bitmap>>("bitmap", n, ops);
+        run<Sharded<RCPoolPolicy>>("sharded", n, ops);
+        run<Tuned>("tuned", n, ops);
+        pairs(n, ops / 4);
+    }
+    std::printf("ok\n");
+    return 0;
+}